@@ -0,0 +1,542 @@
+// Microbenchmarks for the transfer primitives, in the style of Google Benchmark: a benchmark is a
+// function whose measured loop runs while state.keepRunning(). The harness grows the iteration
+// count until one run takes at least MIN_RUN_SECONDS, then reports the time per iteration and,
+// where the benchmark sets it, the throughput. Covered:
+//   - sending one file chunk as a frame: sendFileChunk from file_protocol.h (what server2 and
+//     swarm peers do), sendfile (TransmitFile on Windows) and a memory mapped file
+//   - request parsing, file list parsing and formatting (file_protocol.h)
+//   - the CRC-32 kernel and the download state store (download_state.h)
+//   - the client queue (download_queue.h): picking the next file, the duplicate check of a scan
+//     and the request lookup of every frame
+//   - the per-chunk transfer tuning update (socket_tuning.h)
+//
+// Usage: micro_bench [filter] [--trace trace.json]
+// Only benchmarks whose name contains `filter` run. --trace records every run as a trace event
+// (trace_probe.h), next to whatever probes the measured code has.
+
+#define ENABLE_TRACE
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <map>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <mswsock.h>
+#pragma comment(lib, "Ws2_32.lib")
+#pragma comment(lib, "Mswsock.lib")
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+#define closesocket close
+#define INVALID_SOCKET (-1)
+#define SOCKET_ERROR (-1)
+#endif
+#include "../download_queue.h"
+#include "../download_state.h"
+#include "../file_protocol.h"
+#include "../socket_tuning.h"
+#include "../trace_probe.h"
+
+#define MIN_RUN_SECONDS 0.5
+#define TEST_FILE "micro_bench.tmp"
+#define TEST_FILE_SIZE (64 * 1024 * 1024)
+
+using namespace std;
+
+class BenchmarkState {
+public:
+    BenchmarkState(int64_t arg, uint64_t iterations) : argument(arg), iterations(iterations) {}
+
+    bool keepRunning() {
+        if (done == 0) {
+            start = chrono::steady_clock::now();
+        }
+        if (done < iterations && skipReason.empty()) {
+            done++;
+            return true;
+        }
+        seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        return false;
+    }
+
+    int64_t arg() const { return argument; }
+    void setBytesProcessed(uint64_t bytes) { bytesProcessed = bytes; }
+    void skip(const string& reason) { skipReason = reason; }
+
+    int64_t argument;
+    uint64_t iterations;
+    uint64_t done = 0;
+    uint64_t bytesProcessed = 0;
+    double seconds = 0;
+    string skipReason;
+    chrono::steady_clock::time_point start;
+};
+
+typedef void (*BenchmarkFunction)(BenchmarkState&);
+
+struct Benchmark {
+    string name;
+    BenchmarkFunction function;
+    int64_t arg;
+};
+
+vector<Benchmark>& registry() {
+    static vector<Benchmark> benchmarks;
+    return benchmarks;
+}
+
+bool registerBenchmark(const string& name, BenchmarkFunction function, const vector<int64_t>& args) {
+    if (args.empty()) {
+        registry().push_back({ name, function, 0 });
+    }
+    for (int64_t arg : args) {
+        registry().push_back({ name + "/" + to_string(arg), function, arg });
+    }
+    return true;
+}
+
+// BENCHMARK(function) runs it once, BENCHMARK(function, 1, 2, 3) once per argument (state.arg())
+#define BENCHMARK(function, ...) static bool function##Registered = registerBenchmark(#function, function, { __VA_ARGS__ })
+
+// Keeps the optimizer from dropping a result
+volatile uint64_t benchmarkSink;
+
+// A loopback connection whose receiving end is drained by a thread, so sends measure the sender
+struct LoopbackSink {
+    SOCKET sender = INVALID_SOCKET;
+    SOCKET receiver = INVALID_SOCKET;
+    thread drain;
+
+    bool open() {
+        SOCKET listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        sockaddr_in address;
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        inet_pton(AF_INET, "127.0.0.1", &address.sin_addr);
+        socklen_t addressLength = sizeof(address);
+        if (listener == INVALID_SOCKET || ::bind(listener, (sockaddr*)&address, sizeof(address)) == SOCKET_ERROR ||
+            listen(listener, 1) == SOCKET_ERROR || getsockname(listener, (sockaddr*)&address, &addressLength) == SOCKET_ERROR) {
+            return false;
+        }
+        receiver = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (connect(receiver, (sockaddr*)&address, sizeof(address)) == SOCKET_ERROR) {
+            closesocket(listener);
+            return false;
+        }
+        sender = accept(listener, NULL, NULL);
+        closesocket(listener);
+        configureTransferSocket(sender);
+
+        SOCKET drained = receiver;
+        drain = thread([drained]() {
+            vector<char> buffer(1024 * 1024);
+            while (recv(drained, buffer.data(), (int)buffer.size(), 0) > 0) {
+            }
+        });
+        return sender != INVALID_SOCKET;
+    }
+
+    ~LoopbackSink() {
+        if (sender != INVALID_SOCKET) {
+            closesocket(sender);
+        }
+        if (drain.joinable()) {
+            drain.join();
+        }
+        if (receiver != INVALID_SOCKET) {
+            closesocket(receiver);
+        }
+    }
+};
+
+bool createTestFile() {
+    ofstream file(TEST_FILE, ios::binary | ios::trunc);
+    vector<char> block(1024 * 1024);
+    for (size_t i = 0; i < block.size(); i++) {
+        block[i] = (char)(i * 2654435761u >> 24);
+    }
+    for (int i = 0; i < TEST_FILE_SIZE / (int)block.size(); i++) {
+        file.write(block.data(), block.size());
+    }
+    return file.good();
+}
+
+// Chunk read + send ------------------------------------------------------------------------
+
+// sendFileChunk, called per chunk by server2: read into a buffer, send header and buffer gathered
+void chunkSendBuffered(BenchmarkState& state) {
+    LoopbackSink sink;
+    ifstream file(TEST_FILE, ios::binary);
+    if (!sink.open() || !file) {
+        state.skip("setup failed");
+    }
+    uint32_t chunk = (uint32_t)state.arg();
+    vector<char> buffer(chunk);
+    uint64_t offset = 0;
+    while (state.keepRunning()) {
+        uint32_t bytesRead;
+        file.seekg(offset);
+        sendFileChunk(sink.sender, 1, file, buffer.data(), chunk, bytesRead);
+        offset = (offset + chunk) % TEST_FILE_SIZE;
+    }
+    state.setBytesProcessed(state.done * chunk);
+}
+BENCHMARK(chunkSendBuffered, 16 * 1024, 64 * 1024, 256 * 1024);
+
+// The kernel copies straight from the page cache, the header goes first
+void chunkSendFile(BenchmarkState& state) {
+    LoopbackSink sink;
+    if (!sink.open()) {
+        state.skip("setup failed");
+    }
+    uint32_t chunk = (uint32_t)state.arg();
+    uint64_t offset = 0;
+#if defined(_WIN32)
+    HANDLE file = CreateFileA(TEST_FILE, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        state.skip("setup failed");
+    }
+    while (state.keepRunning()) {
+        uint32_t header[3] = { htonl(FRAME_DATA), htonl(1), htonl(chunk) };
+        TRANSMIT_FILE_BUFFERS head = { header, sizeof(header), NULL, 0 };
+        LARGE_INTEGER position;
+        position.QuadPart = offset;
+        SetFilePointerEx(file, position, NULL, FILE_BEGIN);
+        TransmitFile(sink.sender, file, chunk, 0, NULL, &head, 0);
+        offset = (offset + chunk) % TEST_FILE_SIZE;
+    }
+    CloseHandle(file);
+#elif defined(__linux__)
+    int file = ::open(TEST_FILE, O_RDONLY);
+    if (file < 0) {
+        state.skip("setup failed");
+    }
+    while (state.keepRunning()) {
+        uint32_t header[3] = { htonl(FRAME_DATA), htonl(1), htonl(chunk) };
+        send(sink.sender, header, sizeof(header), MSG_MORE);
+        off_t position = offset;
+        size_t remaining = chunk;
+        while (remaining > 0) {
+            ssize_t sent = sendfile(sink.sender, file, &position, remaining);
+            if (sent <= 0) {
+                break;
+            }
+            remaining -= sent;
+        }
+        offset = (offset + chunk) % TEST_FILE_SIZE;
+    }
+    ::close(file);
+#else
+    state.skip("no sendfile on this platform");
+    state.keepRunning();
+#endif
+    state.setBytesProcessed(state.done * chunk);
+}
+BENCHMARK(chunkSendFile, 16 * 1024, 64 * 1024, 256 * 1024);
+
+// Send from a mapping of the whole file, no read into a buffer
+void chunkSendMapped(BenchmarkState& state) {
+    LoopbackSink sink;
+    if (!sink.open()) {
+        state.skip("setup failed");
+    }
+    const char* data = NULL;
+#ifdef _WIN32
+    HANDLE file = CreateFileA(TEST_FILE, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping) {
+        data = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    }
+#else
+    int file = ::open(TEST_FILE, O_RDONLY);
+    void* mapped = file >= 0 ? mmap(NULL, TEST_FILE_SIZE, PROT_READ, MAP_PRIVATE, file, 0) : MAP_FAILED;
+    if (mapped != MAP_FAILED) {
+        data = (const char*)mapped;
+    }
+#endif
+    if (!data) {
+        state.skip("setup failed");
+    }
+
+    uint32_t chunk = (uint32_t)state.arg();
+    uint64_t offset = 0;
+    while (state.keepRunning()) {
+        sendFrame(sink.sender, FRAME_DATA, 1, chunk, data + offset, chunk);
+        offset = (offset + chunk) % TEST_FILE_SIZE;
+    }
+    state.setBytesProcessed(state.done * chunk);
+
+#ifdef _WIN32
+    if (data) {
+        UnmapViewOfFile(data);
+    }
+    if (mapping) {
+        CloseHandle(mapping);
+    }
+    CloseHandle(file);
+#else
+    if (data) {
+        munmap((void*)data, TEST_FILE_SIZE);
+    }
+    if (file >= 0) {
+        ::close(file);
+    }
+#endif
+}
+BENCHMARK(chunkSendMapped, 16 * 1024, 64 * 1024, 256 * 1024);
+
+// Request parsing and the file list ---------------------------------------------------------
+
+void parseRequest(BenchmarkState& state) {
+    const string requests[] = { "big.bin|NORMAL", "video_2024_final.mp4|HIGH|1048576|60000000", "big.bin|NORMAL|262144|60000000|262144" };
+    size_t i = 0;
+    while (state.keepRunning()) {
+        FileRequestFields fields;
+        splitFileRequest(requests[i++ % 3], fields);
+        benchmarkSink = fields.fileName.size() + fields.length;
+    }
+}
+BENCHMARK(parseRequest);
+
+vector<FileInfo> makeFileList(size_t count) {
+    vector<FileInfo> fileList;
+    for (size_t i = 0; i < count; i++) {
+        fileList.push_back({ "file_" + to_string(i) + ".bin", (int)(i % 500) });
+    }
+    return fileList;
+}
+
+void formatCatalog(BenchmarkState& state) {
+    vector<FileInfo> fileList = makeFileList(state.arg());
+    size_t bytes = 0;
+    while (state.keepRunning()) {
+        string text = formatFileList(fileList);
+        bytes += text.size();
+    }
+    state.setBytesProcessed(bytes);
+}
+BENCHMARK(formatCatalog, 10, 1000);
+
+void parseCatalog(BenchmarkState& state) {
+    string text = formatFileList(makeFileList(state.arg()));
+    while (state.keepRunning()) {
+        istringstream input(text);
+        benchmarkSink = parseFileList(input).size();
+    }
+    state.setBytesProcessed(state.done * text.size());
+}
+BENCHMARK(parseCatalog, 10, 1000);
+
+// Checksums and the state store -------------------------------------------------------------
+
+void checksum(BenchmarkState& state) {
+    vector<char> data(state.arg(), 'x');
+    uint32_t crc = 0;
+    while (state.keepRunning()) {
+        crc = crc32(data.data(), data.size(), crc);
+    }
+    benchmarkSink = crc;
+    state.setBytesProcessed(state.done * data.size());
+}
+BENCHMARK(checksum, 64, 4 * 1024, 256 * 1024);
+
+void stateStoreFind(BenchmarkState& state) {
+    remove("micro_bench.db");
+    DownloadStateStore store(".");
+    store.open("micro_bench.db", "");
+    for (int i = 0; i < 10000; i++) {
+        store.markComplete("file_" + to_string(i) + ".bin", i, i);
+    }
+    int i = 0;
+    while (state.keepRunning()) {
+        benchmarkSink = store.isComplete("file_" + to_string(i++ % 20000) + ".bin");
+    }
+}
+BENCHMARK(stateStoreFind);
+
+// The checkpoint downloadFileChunk writes every CHECKPOINT_BYTES
+void stateStoreCheckpoint(BenchmarkState& state) {
+    remove("micro_bench.db");
+    DownloadStateStore store(".");
+    store.open("micro_bench.db", "");
+    uint64_t offset = 0;
+    while (state.keepRunning()) {
+        offset += 256 * 1024;
+        store.savePartial("big.bin", 1ull << 40, offset, (uint32_t)offset);
+    }
+}
+BENCHMARK(stateStoreCheckpoint);
+
+// Client queue and tuning -------------------------------------------------------------------
+
+map<string, int> priorities = { {"CRITICAL", 10}, {"HIGH", 4}, {"NORMAL", 1} };
+
+int priorityValue(const string& priority) {
+    auto it = priorities.find(priority);
+    return it != priorities.end() ? it->second : priorities.at("NORMAL");
+}
+
+// A DownloadQueue with `count` files waiting, as client2 has after scanning a long input.txt
+void fillQueue(DownloadQueue& queue, size_t count) {
+    const char* names[] = { "NORMAL", "HIGH", "CRITICAL" };
+    for (size_t i = 0; i < count; i++) {
+        const char* priority = names[i * 7 % 3];
+        queue.push(queue.intern("file_" + to_string(i) + ".bin"), priority, priorityValue(priority));
+    }
+}
+
+// How client2 moves the next file into flight, the file then fails and waits again
+void queuePickNext(BenchmarkState& state) {
+    DownloadQueue queue;
+    fillQueue(queue, state.arg());
+    uint32_t requestId = 1;
+    while (state.keepRunning()) {
+        Download& next = queue.pop(requestId);
+        queue.finishRequest(requestId++);
+        queue.push(next, next.priority, priorityValue(next.priority));
+    }
+}
+BENCHMARK(queuePickNext, 32, 1024, 16384);
+
+// The duplicate check of one input.txt line against the waiting files
+void queueDuplicateCheck(BenchmarkState& state) {
+    DownloadQueue queue;
+    fillQueue(queue, state.arg());
+    string queued = "file_" + to_string(state.arg() / 2) + ".bin";
+    while (state.keepRunning()) {
+        benchmarkSink = queue.push(queue.intern(queued), "NORMAL", priorityValue("NORMAL"));
+    }
+}
+BENCHMARK(queueDuplicateCheck, 32, 1024, 16384);
+
+// The request id lookup client2 does for every frame
+void queueRequestLookup(BenchmarkState& state) {
+    DownloadQueue queue;
+    fillQueue(queue, 1024);
+    for (uint32_t requestId = 1; requestId <= 32; requestId++) {
+        queue.pop(requestId);
+    }
+    uint32_t i = 0;
+    while (state.keepRunning()) {
+        Download* download = queue.findRequest(i++ % 32 + 1);
+        download->bytesReceived += 1024;
+    }
+}
+BENCHMARK(queueRequestLookup);
+
+// Called for every chunk sent or received, nearly always the cheap path
+void tuningUpdate(BenchmarkState& state) {
+    LoopbackSink sink;
+    if (!sink.open()) {
+        state.skip("setup failed");
+    }
+    TransferTuner tuner;
+    while (state.keepRunning()) {
+        benchmarkSink = updateTransferTuning(sink.sender, tuner, 64 * 1024, true);
+    }
+}
+BENCHMARK(tuningUpdate);
+
+// Runner ----------------------------------------------------------------------------------
+
+string formatRate(double bytesPerSecond) {
+    ostringstream text;
+    text << fixed << setprecision(1);
+    if (bytesPerSecond >= 1e9) {
+        text << bytesPerSecond / (1024.0 * 1024 * 1024) << " GB/s";
+    }
+    else {
+        text << bytesPerSecond / (1024.0 * 1024) << " MB/s";
+    }
+    return text.str();
+}
+
+int main(int argc, char* argv[]) {
+    string filter;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--trace" && i + 1 < argc) {
+#ifdef _WIN32
+            _putenv_s("TRACE_FILE", argv[++i]);
+#else
+            setenv("TRACE_FILE", argv[++i], 1);
+#endif
+        }
+        else {
+            filter = arg;
+        }
+    }
+
+#ifdef _WIN32
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+        cerr << "WSAStartup failed" << endl;
+        return 1;
+    }
+#endif
+    if (!createTestFile()) {
+        cerr << "Unable to write " << TEST_FILE << endl;
+        return 1;
+    }
+
+    cout << left << setw(36) << "Benchmark" << right << setw(14) << "Time" << setw(14) << "Iterations" << setw(14) << "Throughput" << endl;
+    cout << string(78, '-') << endl;
+    for (const auto& benchmark : registry()) {
+        if (benchmark.name.find(filter) == string::npos) {
+            continue;
+        }
+
+        // Grow the iteration count until a run is long enough to trust
+        uint64_t iterations = 1;
+        BenchmarkState state(benchmark.arg, iterations);
+        while (true) {
+            state = BenchmarkState(benchmark.arg, iterations);
+            {
+                TraceScope scope(benchmark.name.c_str());
+                benchmark.function(state);
+            }
+            if (!state.skipReason.empty() || state.seconds >= MIN_RUN_SECONDS || iterations >= 1000000000) {
+                break;
+            }
+            double scale = MIN_RUN_SECONDS * 1.4 / max(state.seconds, 1e-9);
+            iterations = max(iterations + 1, (uint64_t)(iterations * min(scale, 100.0)));
+        }
+
+        cout << left << setw(36) << benchmark.name << right;
+        if (!state.skipReason.empty()) {
+            cout << "  skipped: " << state.skipReason << endl;
+            continue;
+        }
+        ostringstream time;
+        time << fixed << setprecision(1) << state.seconds * 1e9 / state.done << " ns";
+        cout << setw(14) << time.str() << setw(14) << state.done;
+        if (state.bytesProcessed > 0) {
+            cout << setw(14) << formatRate(state.bytesProcessed / state.seconds);
+        }
+        cout << endl;
+    }
+
+    remove(TEST_FILE);
+    remove("micro_bench.db");
+#ifdef _WIN32
+    WSACleanup();
+#endif
+    TRACE_FLUSH();
+    return 0;
+}
@@ -0,0 +1,26 @@
+#!/bin/sh
+# Runs transfer_bench over loopback with simulated links (Linux, needs root and sch_netem).
+# netem delays every packet leaving lo, so both directions are delayed: RTT = 2 x delay.
+# Each profile needs to run for well over a second, or the tuner never gets past its first intervals.
+set -e
+cd "$(dirname "$0")"
+g++ -O2 -std=c++17 -pthread -o transfer_bench transfer_bench.cpp
+
+trap 'tc qdisc del dev lo root 2>/dev/null || true' EXIT
+
+run() {
+    name=$1
+    megabytes=$2
+    shift 2
+    tc qdisc add dev lo root netem "$@"
+    echo "== $name: $*"
+    ./transfer_bench "$megabytes"
+    tc qdisc del dev lo root
+}
+
+echo "== loopback"
+./transfer_bench 2048
+run lan 256 delay 0.25ms rate 1gbit
+run wan 64 delay 25ms rate 100mbit
+run lossy-wan 32 delay 40ms 10ms loss 0.5% rate 50mbit
+run mobile 8 delay 60ms 20ms loss 1% rate 10mbit
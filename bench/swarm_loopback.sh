@@ -0,0 +1,97 @@
+#!/bin/sh
+# Swarm test on one machine: server2 and CLIENTS client2 processes on loopback, each client in its
+# own folder with its own input.txt, output/ and peer port. KILLED of them are killed (kill -9)
+# once the downloads are under way and started again, which covers resuming and peers that
+# disappear. When every client holds every file, all outputs are compared with the server copies.
+#
+# Usage: bench/swarm_loopback.sh [clients] [killed] [files]
+# SERVER2 and CLIENT2 name the binaries (default ./server2 and ./client2). The server listens on
+# 8080 and 8081, clients use peer ports 9001 and up. File i is i MB, so 8 files are 36MB.
+# TIMEOUT (seconds, default 300) bounds the run, KEEP=1 keeps the work folder for a look at the logs.
+set -e
+
+CLIENTS=${1:-16}
+KILLED=${2:-2}
+FILES=${3:-8}
+TIMEOUT=${TIMEOUT:-300}
+SERVER2=$(cd "$(dirname "${SERVER2:-./server2}")" && pwd)/$(basename "${SERVER2:-./server2}")
+CLIENT2=$(cd "$(dirname "${CLIENT2:-./client2}")" && pwd)/$(basename "${CLIENT2:-./client2}")
+WORK=$(mktemp -d)
+
+cleanup() {
+    for pid in $CLIENT_PIDS; do
+        kill -INT "$pid" 2>/dev/null || true
+    done
+    [ -n "$SERVER_PID" ] && kill -INT "$SERVER_PID" 2>/dev/null || true
+    sleep 1
+    if [ "$KEEP" = 1 ]; then
+        echo "Logs kept in $WORK"
+    else
+        rm -rf "$WORK"
+    fi
+}
+trap cleanup EXIT
+
+# Client i runs in client<i>/ with peer port 9000 + i, its pid goes into PID_<i>
+start_client() {
+    (cd "$WORK/client$1" && echo "client$1" | exec "$CLIENT2" 8 $((9000 + $1)) >> log 2>&1) &
+    eval "PID_$1=$!"
+}
+
+mkdir "$WORK/server"
+for i in $(seq 1 "$FILES"); do
+    head -c $((i * 1024 * 1024)) /dev/urandom > "$WORK/server/f$i.bin"
+    echo "f$i.bin $i" >> "$WORK/server/file_list.txt"
+done
+(cd "$WORK/server" && exec "$SERVER2" > log 2>&1) &
+SERVER_PID=$!
+sleep 1
+
+for c in $(seq 1 "$CLIENTS"); do
+    mkdir -p "$WORK/client$c/output"
+    for i in $(seq 1 "$FILES"); do
+        echo "f$i.bin NORMAL" >> "$WORK/client$c/input.txt"
+    done
+done
+
+start=$(date +%s)
+for c in $(seq 1 "$CLIENTS"); do
+    start_client "$c"
+done
+sleep 2
+for c in $(seq 1 "$KILLED"); do
+    eval "kill -9 \$PID_$c" 2>/dev/null || true
+    echo "Killed client$c with $(du -sk "$WORK/client$c/output" | cut -f1)KB downloaded"
+done
+sleep 1
+for c in $(seq 1 "$KILLED"); do
+    start_client "$c"
+done
+CLIENT_PIDS=$(for c in $(seq 1 "$CLIENTS"); do eval "echo \$PID_$c"; done)
+
+# Done when every client has every file byte for byte
+while true; do
+    missing=0
+    for c in $(seq 1 "$CLIENTS"); do
+        for i in $(seq 1 "$FILES"); do
+            cmp -s "$WORK/server/f$i.bin" "$WORK/client$c/output/f$i.bin" || missing=$((missing + 1))
+        done
+    done
+    elapsed=$(($(date +%s) - start))
+    if [ "$missing" = 0 ] || [ "$elapsed" -ge "$TIMEOUT" ]; then
+        break
+    fi
+    sleep 1
+done
+
+total=$((CLIENTS * FILES))
+echo "$CLIENTS clients, $KILLED killed and restarted, $FILES files: $((total - missing))/$total complete and identical after ${elapsed}s"
+echo "Server finished sending $(grep -c "Completed sending" "$WORK/server/log" || true) files or pieces"
+if [ "$missing" != 0 ]; then
+    for c in $(seq 1 "$CLIENTS"); do
+        for i in $(seq 1 "$FILES"); do
+            cmp -s "$WORK/server/f$i.bin" "$WORK/client$c/output/f$i.bin" || echo "  client$c: f$i.bin missing or different"
+        done
+    done
+    exit 1
+fi
@@ -0,0 +1,169 @@
+// Transfer engine benchmark: streams the same payload over a loopback TCP connection with
+//   old:   1KB chunks, frame header and payload sent separately, default socket options
+//   fixed: MAX_CHUNK_SIZE chunks, gathered frames and socket options, no adaptation
+//   tuned: socket_tuning.h (adaptive chunks and buffers, gathered frames, TCP_NODELAY)
+// and prints the throughput of each. fixed vs tuned is what the adaptive logic itself adds,
+// old vs fixed is only bigger chunks and fewer system calls. The tuner retunes once per
+// TUNE_INTERVAL_MS, a transfer shorter than that runs entirely on INITIAL_CHUNK_SIZE, the
+// bench says so instead of crediting the tuner.
+//
+// On its own it measures plain loopback. bench/netem_profiles.sh runs it under simulated
+// LAN / WAN / lossy links with tc netem (Linux), which is why it also builds without Winsock.
+//
+// Usage: transfer_bench [megabytes]
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <thread>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "Ws2_32.lib")
+#else
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/uio.h>
+#define closesocket close
+#define INVALID_SOCKET (-1)
+#define SOCKET_ERROR (-1)
+#endif
+#include "../file_protocol.h"
+#include "../socket_tuning.h"
+
+#define OLD_CHUNK_SIZE 1024
+
+enum Engine {
+    ENGINE_OLD,
+    ENGINE_FIXED,
+    ENGINE_TUNED
+};
+
+using namespace std;
+
+void sender(SOCKET socket, const vector<char>& payload, Engine engine) {
+    TransferTuner tuner;
+    if (engine != ENGINE_OLD) {
+        configureTransferSocket(socket);
+    }
+
+    int retunes = 0;
+    size_t offset = 0;
+    while (offset < payload.size()) {
+        uint32_t chunkSize = engine == ENGINE_OLD ? OLD_CHUNK_SIZE : engine == ENGINE_FIXED ? MAX_CHUNK_SIZE : tuner.chunkSize;
+        uint32_t length = (uint32_t)min((size_t)chunkSize, payload.size() - offset);
+        uint32_t header[3] = { htonl(FRAME_DATA), htonl(1), htonl(length) };
+
+        bool sent = engine != ENGINE_OLD ? sendFrame(socket, FRAME_DATA, 1, length, &payload[offset], length)
+            : sendAll(socket, (char*)header, sizeof(header)) && sendAll(socket, &payload[offset], length);
+        if (!sent) {
+            cerr << "Send failed" << endl;
+            return;
+        }
+        offset += length;
+        if (engine == ENGINE_TUNED) {
+            // Counts intervals that were evaluated, whether or not they changed anything
+            auto intervalStart = tuner.intervalStart;
+            updateTransferTuning(socket, tuner, length, true);
+            retunes += tuner.intervalStart != intervalStart;
+        }
+    }
+
+    if (engine == ENGINE_TUNED) {
+        if (retunes == 0) {
+            cout << "    tuner never ran (transfer shorter than " << TUNE_INTERVAL_MS << "ms), sent with "
+                << tuner.chunkSize / 1024 << "KB chunks" << endl;
+        }
+        else {
+            cout << "    " << retunes << " tuning intervals, final chunk " << tuner.chunkSize / 1024 << "KB, send buffer "
+                << tuner.socketBufferSize / 1024 << "KB, rtt " << tuner.rttMicroseconds << "us" << endl;
+        }
+    }
+}
+
+// Returns the throughput in MB/s
+double runTransfer(const vector<char>& payload, Engine engine) {
+    SOCKET listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = 0;
+    inet_pton(AF_INET, "127.0.0.1", &address.sin_addr);
+    socklen_t addressLength = sizeof(address);
+    if (listener == INVALID_SOCKET || ::bind(listener, (sockaddr*)&address, sizeof(address)) == SOCKET_ERROR ||
+        listen(listener, 1) == SOCKET_ERROR || getsockname(listener, (sockaddr*)&address, &addressLength) == SOCKET_ERROR) {
+        cerr << "Unable to listen on loopback" << endl;
+        return 0;
+    }
+
+    SOCKET client = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (connect(client, (sockaddr*)&address, sizeof(address)) == SOCKET_ERROR) {
+        cerr << "Unable to connect on loopback" << endl;
+        return 0;
+    }
+    SOCKET server = accept(listener, NULL, NULL);
+    closesocket(listener);
+
+    auto start = chrono::steady_clock::now();
+    thread senderThread(sender, server, cref(payload), engine);
+
+    // Receive frame by frame like client2.cpp does
+    TransferTuner tuner;
+    if (engine != ENGINE_OLD) {
+        configureTransferSocket(client);
+    }
+    vector<char> buffer(MAX_CHUNK_SIZE);
+    size_t received = 0;
+    while (received < payload.size()) {
+        uint32_t header[3];
+        uint32_t length;
+        if (!recvAll(client, (char*)header, sizeof(header)) || (length = ntohl(header[2])) > buffer.size() ||
+            !recvAll(client, buffer.data(), length)) {
+            cerr << "Receive failed" << endl;
+            break;
+        }
+        received += length;
+        if (engine == ENGINE_TUNED) {
+            updateTransferTuning(client, tuner, length, false);
+        }
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    senderThread.join();
+    closesocket(client);
+    closesocket(server);
+    return received / seconds / (1024 * 1024);
+}
+
+int main(int argc, char* argv[]) {
+#ifdef _WIN32
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+        cerr << "WSAStartup failed" << endl;
+        return 1;
+    }
+#endif
+
+    size_t megabytes = argc > 1 ? atoi(argv[1]) : 256;
+    vector<char> payload(megabytes * 1024 * 1024);
+    for (size_t i = 0; i < payload.size(); i++) {
+        payload[i] = (char)(i * 2654435761u >> 24);
+    }
+
+    cout << "Transferring " << megabytes << "MB" << endl;
+    double oldThroughput = runTransfer(payload, ENGINE_OLD);
+    cout << "  old engine:   " << oldThroughput << " MB/s" << endl;
+    double fixedThroughput = runTransfer(payload, ENGINE_FIXED);
+    cout << "  fixed chunks: " << fixedThroughput << " MB/s (" << fixedThroughput / oldThroughput << "x old)" << endl;
+    double tunedThroughput = runTransfer(payload, ENGINE_TUNED);
+    cout << "  tuned engine: " << tunedThroughput << " MB/s (" << tunedThroughput / oldThroughput << "x old, "
+        << tunedThroughput / fixedThroughput << "x fixed)" << endl;
+
+#ifdef _WIN32
+    WSACleanup();
+#endif
+    return 0;
+}
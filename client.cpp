@@ -3,63 +3,79 @@
 #include <sstream>
 #include <string>
 #include <vector>
-#include <set>
+#include <deque>
+#include <cstdlib>
 #include <algorithm>
 #include <winsock2.h>
 #include <ws2tcpip.h>
 #include <signal.h>
+#include "download_state.h"
+#include "socket_io.h"
+#include "socket_tuning.h"
 #pragma comment(lib, "Ws2_32.lib")
 
 #define PORT 8080
-#define BUFFER_SIZE 1024
+#define BUFFER_SIZE (64 * 1024) // Control messages, file data goes in chunks sized by socket_tuning.h
 #define INPUT_FILE "input.txt"
-#define DOWNLOADED_FILE_LIST "downloaded_files.txt"
+#define DOWNLOADED_FILE_LIST "downloaded_files.txt" // Old plain list, imported into downloads.db once
+#define PIPELINE_WINDOW 8 // Default number of requests kept in flight, override with the first argument
 volatile bool keepRunning = true;
 
 using namespace std;
 
-// Function to download a file from the server
-void downloadFile(SOCKET socket, const string& fileName) {
-    // Send requested file name to server
-    send(socket, fileName.c_str(), fileName.size(), 0);
+// Send several file names as one batched request: uint32 count, then uint32 name length + name per file
+bool sendFileRequests(SOCKET socket, const vector<string>& fileNames) {
+    string message;
+    uint32_t numFiles = htonl(fileNames.size());
+    message.append((char*)&numFiles, sizeof(numFiles));
+    for (const auto& fileName : fileNames) {
+        uint32_t nameLength = htonl(fileName.size());
+        message.append((char*)&nameLength, sizeof(nameLength));
+        message.append(fileName);
+    }
+    return sendAll(socket, message.c_str(), message.size());
+}
 
+// Function to receive one requested file from the server, returns false if the connection is unusable
+bool downloadFile(SOCKET socket, const string& fileName, uint32_t& fileSize, uint32_t& checksum, TransferTuner& tuner) {
     // Receive file size
-    uint32_t fileSize;
-    int result = recv(socket, (char*)&fileSize, sizeof(fileSize), 0);
-    if (result <= 0) {
+    checksum = 0;
+    if (!recvAll(socket, (char*)&fileSize, sizeof(fileSize))) {
         cerr << "Error receiving file size for " << fileName << "\n";
-        return;
+        return false;
     }
     fileSize = ntohl(fileSize);  // Convert from network byte order to host byte order
     if (fileSize == 0) {
         cerr << "File " << fileName << " not found on server or invalid file size.\n";
-        return;
+        return true;
     }
 
     cout << "File size of " << fileName << ": " << fileSize << " bytes\n";
 
-    // Receive file data and save to output folder
+    // Receive file data and save to output folder, a failed open still has to drain the data
     ofstream file("output/" + fileName, ios::binary);
     if (!file.is_open()) {
         cerr << "Unable to open file for writing: output/" << fileName << "\n";
-        return;
     }
 
-    char buffer[BUFFER_SIZE];
+    vector<char> buffer(MAX_CHUNK_SIZE);
     uint32_t totalBytesRead = 0;
     uint32_t previousPercentage = 0; // To track the previous percentage displayed
 
     while (totalBytesRead < fileSize) {
-        int bytesRead = recv(socket, buffer, BUFFER_SIZE, 0);
+        // Never read past this file, the next pipelined response follows right after it
+        int bytesRead = recv(socket, buffer.data(), min((uint32_t)buffer.size(), fileSize - totalBytesRead), 0);
         if (bytesRead <= 0) {
             cerr << "Connection lost or error while receiving " << fileName << ".\n";
             break;
         }
-        file.write(buffer, bytesRead);
+        file.write(buffer.data(), bytesRead);
+        checksum = crc32(buffer.data(), bytesRead, checksum);
         totalBytesRead += bytesRead;
+        updateTransferTuning(socket, tuner, bytesRead, false);
 
         // Calculate the current percentage
-        uint32_t percentage = (totalBytesRead * 100) / fileSize;
+        uint32_t percentage = (uint64_t)totalBytesRead * 100 / fileSize;
 
         // Only update percentage if it has changed
         if (percentage != previousPercentage) {
@@ -70,22 +86,22 @@ void downloadFile(SOCKET socket, const string& fileName) {
     file.close();
     if (totalBytesRead == fileSize) {
         cout << "Completely downloaded " << fileName << endl;
+        return true;
     }
-    else {
-        cerr << "Failed to download " << fileName << endl;
-    }
-}
 
+    cerr << "Failed to download " << fileName << endl;
+    return false;
+}
 
 // Function to read the list of files to download
-vector<string> readFileList(const string& filename, const set<string>& downloadedFiles) {
+vector<string> readFileList(const string& filename, DownloadStateStore& downloadState) {
     vector<string> fileList;
     ifstream file(filename);
     string line;
 
     while (getline(file, line)) {
-        if (!line.empty() && downloadedFiles.find(line) == downloadedFiles.end()) // Check if line is not empty
-            // and line is not in downloaded_files.txt, mean that file is not downloaded
+        if (!line.empty() && !downloadState.isComplete(line)) // Check if line is not empty
+            // and the file is not recorded as downloaded yet
         {
             fileList.push_back(line);
         }
@@ -94,40 +110,52 @@ vector<string> readFileList(const string& filename, const set<string>& downloade
     return fileList;
 }
 
+// Keep up to `window` requests in flight so the server streams responses back-to-back
+// instead of waiting one round trip per file. Responses arrive in request order.
+bool downloadFiles(SOCKET socket, const vector<string>& fileNames, size_t window, DownloadStateStore& downloadState, TransferTuner& tuner) {
+    deque<string> inFlight;
+    size_t nextToRequest = 0;
 
-// Function to read already downloaded files
-set<string> readDownloadedFiles() {
-    set<string> downloadedFiles;
-    ifstream file(DOWNLOADED_FILE_LIST);
-    string line;
+    while (nextToRequest < fileNames.size() || !inFlight.empty()) {
+        vector<string> batch;
+        while (inFlight.size() + batch.size() < window && nextToRequest < fileNames.size()) {
+            batch.push_back(fileNames[nextToRequest++]);
+        }
+        if (!batch.empty()) {
+            if (!sendFileRequests(socket, batch)) {
+                cerr << "Error sending file requests\n";
+                return false;
+            }
+            inFlight.insert(inFlight.end(), batch.begin(), batch.end());
+        }
 
-    while (getline(file, line)) {
-        if (!line.empty()) {
-            downloadedFiles.insert(line);
+        string fileName = inFlight.front();
+        inFlight.pop_front();
+        uint32_t fileSize;
+        uint32_t checksum;
+        if (!downloadFile(socket, fileName, fileSize, checksum, tuner)) {
+            return false;
         }
+
+        downloadState.markComplete(fileName, fileSize, checksum);
     }
 
-    return downloadedFiles;
+    return true;
 }
 
-// Function to save downloaded file names
-void saveDownloadedFile(const string& fileName) {
-    ofstream file(DOWNLOADED_FILE_LIST, ios::app);
-    if (file.is_open()) {
-        file << fileName << endl;
-        file.close();
-    }
-    else {
-        cerr << "Unable to open file: " << DOWNLOADED_FILE_LIST << endl;
-    }
-}
 void signal_callback_handler(int signum) {
     cout << "Exit..." << endl;
     keepRunning = false;
     exit(signum);
 }
-int main() {
+int main(int argc, char* argv[]) {
     signal(SIGINT, signal_callback_handler);
+
+    size_t pipelineWindow = PIPELINE_WINDOW;
+    if (argc > 1 && atoi(argv[1]) > 0) {
+        pipelineWindow = atoi(argv[1]);
+    }
+
     WSADATA wsaData;
     int result;
 
@@ -161,6 +189,9 @@ int main() {
         return -1;
     }
 
+    TransferTuner tuner;
+    configureTransferSocket(sock);
+
     // Get client name
     string clientName;
     cout << "Enter your name: ";
@@ -176,18 +207,20 @@ int main() {
         cout << "Available files:\n" << string(buffer, valread) << endl;
     }
 
-    set<string> downloadedFiles = readDownloadedFiles();
+    DownloadStateStore downloadState("output");
+    if (!downloadState.open(DOWNLOAD_STATE_FILE, DOWNLOADED_FILE_LIST)) {
+        closesocket(sock);
+        WSACleanup();
+        return 1;
+    }
 
 
     while (keepRunning) {
-        vector<string> filesToDownload = readFileList(INPUT_FILE, downloadedFiles);
+        vector<string> filesToDownload = readFileList(INPUT_FILE, downloadState);
 
-        for (const auto& fileName : filesToDownload) {
-            downloadFile(sock, fileName);
-
-            // Save the file name to downloaded_files.txt
-            saveDownloadedFile(fileName);
-            downloadedFiles.insert(fileName);
+        if (!downloadFiles(sock, filesToDownload, pipelineWindow, downloadState, tuner)) {
+            cerr << "Lost connection to server" << endl;
+            break;
         }
 
         if (keepRunning) {
@@ -12,30 +12,66 @@
 #include <ws2tcpip.h>
 #include <mutex>
 #include <signal.h>
+#include <cstdlib>
+#include <filesystem>
+#include <memory>
+#include <random>
+#include "download_queue.h"
+#include "download_state.h"
+#include "file_protocol.h"
+#include "socket_tuning.h"
+#include "trace_probe.h"
 
 #pragma comment(lib, "Ws2_32.lib")
 
 #define PORT 8080
-#define BUFFER_SIZE 1024
+#define BUFFER_SIZE (64 * 1024) // Control messages, file data goes in chunks sized by socket_tuning.h
+#define MAX_REQUEST_LENGTH 1024 // Longest piece request a peer may send
 #define INPUT_FILE "input.txt"
-#define DOWNLOADED_FILE_LIST "downloaded_files.txt"
+#define DOWNLOADED_FILE_LIST "downloaded_files.txt" // Old plain list, imported into downloads.db once
+#define CHECKPOINT_BYTES (256 * 1024) // Save the progress of a download every time this much has arrived
+#define PIPELINE_WINDOW 32 // Default number of requests kept in flight, override with the first argument
+#define REQUEST_BUNDLES 1 // Let the server pack small files of a batch into one bundle
+#define PIECE_SIZE (256 * 1024) // Swarm mode: files are verified and exchanged in pieces of this size, same as the server
+#define ANNOUNCE_INTERVAL_MS 500 // Swarm mode: how often our pieces are announced and the peer list refreshed
+#define STALL_TIMEOUT_MS 3000 // Swarm mode: without progress for this long, pieces no peer has are fetched from the server
 
 using namespace std;
 
-struct FileInfo {
-    string name;
-    uint32_t size;
+// Swarm mode: a file downloaded piece by piece from other clients and the server
+struct SwarmFile {
+    string fileName;
+    uint32_t id;                         // Request the file is in flight under
+    uint32_t fileSize;
+    vector<uint32_t> pieceChecksums;     // From the tracker, every piece is checked whoever sent it
+    string havePieces;                   // '1' for every piece written and verified, announced as is
+    vector<bool> requestedPieces;        // Pieces a fetch thread is working on
+    map<string, string> peerPieces;      // "ip:port" -> that peer's pieces, from the latest tracker reply
+    set<string> failedPeers;             // Peers that broke a transfer, not asked again for this file
+    set<string> activeFetchers;          // Peers (and "origin") a fetch thread is running for
+    uint32_t originIndex = 0;            // Pieces i with i % originCount == originIndex are ours to get from the server
+    uint32_t originCount = 1;
+    chrono::steady_clock::time_point lastProgress;
+    uint64_t bytesFromPeers = 0;
+    uint64_t bytesFromServer = 0;
+    uint32_t lastPercentage = 0;
 };
 
 map<string, int> priorities = { {"CRITICAL", 10}, {"HIGH", 4}, {"NORMAL", 1} };
 mutex downloadQueueMutex;
-vector<pair<string, string>> downloadQueue;
-set<string> downloadedFiles;
-map<string, uint32_t> fileSizes;
-map<string, uint32_t> bytesReceived;
-map<string, uint32_t> lastPercentage;
-
-vector<pair<string, string>> readFileList(const string& filename, const set<string>& downloadedFiles) {
+DownloadQueue downloadQueue; // Every file of input.txt, waiting ones by priority, at most pipelineWindow in flight
+uint32_t nextRequestId = 1;
+size_t pipelineWindow = PIPELINE_WINDOW;
+TransferTuner receiveTuner; // Receive buffer for the connection, only the receiving thread uses it
+DownloadStateStore downloadState("output");
+
+uint16_t peerPort = 0;     // Swarm mode when set: other clients fetch our verified pieces on this port
+sockaddr_in serverAddress;
+mutex swarmMutex;
+map<string, shared_ptr<SwarmFile>> swarmFiles; // Kept after completion, so the file is still served to peers
+
+vector<pair<string, string>> readFileList(const string& filename, DownloadStateStore& downloadState) {
+    TRACE_SCOPE("readFileList");
     vector<pair<string, string>> fileList;
     ifstream file(filename);
     string line;
@@ -50,7 +86,7 @@ vector<pair<string, string>> readFileList(const string& filename, const set<stri
             string name = line.substr(0, pos);
             string priority = line.substr(pos + 1);
 
-            if (downloadedFiles.find(name) == downloadedFiles.end()) {
+            if (!downloadState.isComplete(name)) {
                 fileList.push_back({ name, priority });
             }
         }
@@ -59,151 +95,727 @@ vector<pair<string, string>> readFileList(const string& filename, const set<stri
     return fileList;
 }
 
-set<string> readDownloadedFiles() {
-    set<string> downloadedFiles;
-    ifstream file(DOWNLOADED_FILE_LIST);
+int priorityValue(const string& priority) {
+    auto it = priorities.find(priority);
+    return it != priorities.end() ? it->second : priorities.at("NORMAL");
+}
 
-    if (!file.is_open()) {
-        return downloadedFiles;
+// Top up the pipeline: once half of the window has drained, move queued files (highest
+// priority first) into flight until the window is full and send them as one batch, which
+// gives the server enough small files to bundle. Caller must hold downloadQueueMutex.
+bool requestQueuedFiles(SOCKET sock) {
+    TRACE_SCOPE("requestQueuedFiles");
+    if (downloadQueue.inFlightCount() > pipelineWindow / 2) {
+        return true;
     }
-    string line;
 
-    while (getline(file, line)) {
-        if (!line.empty()) {
-            downloadedFiles.insert(line);
-            cout << "Read downloaded file: " << line << endl;
+    string batch;
+    uint32_t numFiles = 0;
+
+    while (downloadQueue.inFlightCount() < pipelineWindow && !downloadQueue.empty()) {
+        Download& next = downloadQueue.pop(nextRequestId);
+
+        // Send request id, length, then file name and priority with a delimiter. A download that
+        // was interrupted also sends how far it got and the size it expects, the server resumes
+        // from there if its copy still has that size.
+        // In swarm mode the file is announced instead, the tracker reply starts the piece download.
+        string dataToSend = next.fileName + "|" + next.priority;
+        DownloadRecord record;
+        error_code error;
+        next.resumeOffset = 0;
+        if (peerPort != 0) {
+            dataToSend = next.fileName + "|" + to_string(peerPort) + "|";
+        }
+        else if (downloadState.find(next.fileName, record) && !record.complete && record.offset > 0 &&
+            filesystem::file_size("output/" + next.fileName, error) >= record.offset && !error) {
+            dataToSend += "|" + to_string(record.offset) + "|" + to_string(record.size);
+            next.resumeOffset = record.offset;
         }
+        uint32_t entryHeader[2] = { htonl(nextRequestId++), htonl(dataToSend.size()) };
+        batch.append((char*)entryHeader, sizeof(entryHeader));
+        batch.append(dataToSend);
+        numFiles++;
+    }
+
+    if (numFiles == 0) {
+        return true;
     }
 
-    return downloadedFiles;
+    uint32_t flags = peerPort != 0 ? BATCH_ANNOUNCE : REQUEST_BUNDLES ? BATCH_ALLOW_BUNDLE : 0;
+    uint32_t batchHeader[2] = { htonl(numFiles), htonl(flags) };
+    batch.insert(0, (char*)batchHeader, sizeof(batchHeader));
+    return sendAll(sock, batch.c_str(), batch.size());
 }
 
-void saveDownloadedFile(const string& fileName) {
-    ofstream file(DOWNLOADED_FILE_LIST, ios::app);
-    if (file.is_open()) {
-        file << fileName << endl;
-        file.close();
+// Caller must hold downloadQueueMutex
+void recordDownloadedFile(Download& download, uint32_t fileSize, uint32_t checksum) {
+    if (download.status != DOWNLOAD_COMPLETE) {
+        cout << "Completed downloading file: " << download.fileName << endl;
+        downloadState.markComplete(download.fileName, fileSize, checksum);
+        download.status = DOWNLOAD_COMPLETE;
     }
-    else {
-        cerr << "Unable to open file: " << DOWNLOADED_FILE_LIST << endl;
+}
+
+void finishDownload(SOCKET sock, Download& download) {
+    lock_guard<mutex> lock(downloadQueueMutex);
+    // A file that could not be written is not recorded, the next scan requests it again
+    if (!download.writeFailed) {
+        recordDownloadedFile(download, download.fileSize, download.checksum);
+    }
+
+    // A slot in the window is free again, request the next queued file right away
+    downloadQueue.finishRequest(download.requestId);
+    if (!requestQueuedFiles(sock)) {
+        cerr << "Error sending file requests\n";
     }
 }
 
-static set<string> completedFiles;
+bool downloadFileChunk(SOCKET sock, Download& download, uint32_t chunkLength) {
+    TRACE_SCOPE("downloadFileChunk");
+    static vector<char> databuffer(MAX_CHUNK_SIZE); // Only the receiving thread gets here
+    if (chunkLength > MAX_CHUNK_SIZE || !recvAll(sock, databuffer.data(), chunkLength)) {
+        cerr << "Error receiving file data for " << download.fileName << endl;
+        return false;
+    }
 
-void downloadFileChunk(SOCKET sock, const string& fileName, int chunksToReceive) {
-    while (bytesReceived[fileName] < fileSizes[fileName]) {
-        char databuffer[BUFFER_SIZE];
-        int bytesRead = recv(sock, databuffer, min(BUFFER_SIZE, fileSizes[fileName] - bytesReceived[fileName]), 0);
-        if (bytesRead <= 0) {
-            cerr << "Error receiving file data for " << fileName << endl;
-            return;
+    // After a failed write the rest of the transfer is still received, only to keep the stream in step
+    if (!download.writeFailed) {
+        ofstream outFile("output/" + download.fileName, ios::binary | ios::app);
+        outFile.write(databuffer.data(), chunkLength);
+        outFile.close();
+        if (!outFile) {
+            cerr << "Error writing output file for " << download.fileName << ", it will be requested again" << endl;
+            download.writeFailed = true;
+        }
+    }
+    updateTransferTuning(sock, receiveTuner, chunkLength, false);
+
+    uint32_t previousBytes = download.bytesReceived;
+    download.bytesReceived += chunkLength;
+    download.checksum = crc32(databuffer.data(), chunkLength, download.checksum);
+
+    // The chunk is already written, so the saved offset never runs ahead of the output file
+    if (previousBytes / CHECKPOINT_BYTES != download.bytesReceived / CHECKPOINT_BYTES &&
+        download.bytesReceived < download.fileSize && !download.writeFailed) {
+        downloadState.savePartial(download.fileName, download.fileSize, download.bytesReceived, download.checksum);
+    }
+
+    uint32_t percentage = min((uint64_t)100, (uint64_t)download.bytesReceived * 100 / download.fileSize);
+    if (percentage != download.lastPercentage) {
+        cout << "Downloading " << download.fileName << "...." << percentage << "% complete" << endl;
+        download.lastPercentage = percentage;
+    }
+
+    if (download.bytesReceived >= download.fileSize) {
+        finishDownload(sock, download);
+    }
+    return true;
+}
+
+// Unpack a bundle straight into output/ while it streams in, one file after another.
+// A file whose checksum does not match is not recorded, so the next scan requests it again.
+bool downloadBundle(SOCKET sock, uint32_t numFiles) {
+    TRACE_SCOPE("downloadBundle");
+    {
+        // Every entry answers a request in flight, a larger count is a broken stream
+        lock_guard<mutex> lock(downloadQueueMutex);
+        if (numFiles == 0 || numFiles > downloadQueue.inFlightCount()) {
+            cerr << "Invalid bundle of " << numFiles << " files\n";
+            return false;
+        }
+    }
+    vector<uint32_t> index(numFiles * 3);
+    if (!recvAll(sock, (char*)index.data(), index.size() * sizeof(uint32_t))) {
+        cerr << "Error receiving bundle index\n";
+        return false;
+    }
+
+    vector<Download*> downloads(numFiles);
+    vector<string> fileNames(numFiles);
+    {
+        lock_guard<mutex> lock(downloadQueueMutex);
+        for (uint32_t i = 0; i < numFiles; i++) {
+            downloads[i] = downloadQueue.findRequest(ntohl(index[i * 3]));
+            if (!downloads[i]) {
+                cerr << "Received bundle entry for unknown request " << ntohl(index[i * 3]) << endl;
+                return false;
+            }
+            fileNames[i] = downloads[i]->fileName;
         }
+    }
+
+    vector<bool> verified(numFiles, false);
+    char databuffer[BUFFER_SIZE];
+    for (uint32_t i = 0; i < numFiles; i++) {
+        uint32_t fileSize = ntohl(index[i * 3 + 1]);
+        uint32_t expectedChecksum = ntohl(index[i * 3 + 2]);
 
-        ofstream outFile("output/" + fileName, ios::binary | ios::app);
+        ofstream outFile("output/" + fileNames[i], ios::binary | ios::trunc);
         if (!outFile) {
-            cerr << "Error opening output file for " << fileName << endl;
-            return;
+            cerr << "Error opening output file for " << fileNames[i] << endl;
+        }
+
+        uint32_t checksum = 0;
+        uint32_t remaining = fileSize;
+        while (remaining > 0) {
+            uint32_t pieceLength = min((uint32_t)BUFFER_SIZE, remaining);
+            if (!recvAll(sock, databuffer, pieceLength)) {
+                cerr << "Error receiving file data for " << fileNames[i] << endl;
+                return false;
+            }
+            outFile.write(databuffer, pieceLength);
+            checksum = crc32(databuffer, pieceLength, checksum);
+            remaining -= pieceLength;
+            updateTransferTuning(sock, receiveTuner, pieceLength, false);
         }
-        outFile.write(databuffer, bytesRead);
         outFile.close();
 
-        bytesReceived[fileName] += bytesRead;
+        if (fileSize == 0) {
+            cerr << "File " << fileNames[i] << " not found on server or empty\n";
+        }
+        verified[i] = outFile.good() && checksum == expectedChecksum;
+        if (!verified[i]) {
+            cerr << "Checksum mismatch for " << fileNames[i] << ", it will be requested again\n";
+        }
+    }
 
-        uint32_t percentage = min(100, (bytesReceived[fileName] * 100) / fileSizes[fileName]);
-        if (percentage != lastPercentage[fileName]) {
-            cout << "Downloading " << fileName << "...." << percentage << "% complete" << endl;
-            lastPercentage[fileName] = percentage;
+    // Record the whole bundle at once so the window is topped up with a single batch
+    lock_guard<mutex> lock(downloadQueueMutex);
+    for (uint32_t i = 0; i < numFiles; i++) {
+        if (verified[i]) {
+            recordDownloadedFile(*downloads[i], ntohl(index[i * 3 + 1]), ntohl(index[i * 3 + 2]));
         }
+        downloadQueue.finishRequest(ntohl(index[i * 3]));
+    }
+    if (!requestQueuedFiles(sock)) {
+        cerr << "Error sending file requests\n";
     }
+    return true;
+}
 
-    if (bytesReceived[fileName] == fileSizes[fileName]) {
-        lock_guard<mutex> lock(downloadQueueMutex);
-        if (completedFiles.find(fileName) == completedFiles.end()) {
-            cout << "Completed downloading file: " << fileName << endl;
-            saveDownloadedFile(fileName);
-            downloadedFiles.insert(fileName);
-            completedFiles.insert(fileName);
+// Swarm mode. The server is the tracker and the seed: every file is announced to it, the reply
+// lists the piece checksums and the peers that have pieces of the file. Pieces are fetched from
+// every peer in parallel, rarest first, so new pieces spread through the swarm quickly. The server
+// is asked only for pieces no peer has yet, split between the peers so each of them normally
+// leaves the server once. Peers and the server speak the same protocol: a piece is a file request
+// with "|offset|size|length" appended, answered with a size frame and data frames.
+
+// Pick the next piece to fetch from `peer` ("origin" for the server), -1 if there is none right
+// now. Caller must hold swarmMutex.
+int pickPiece(SwarmFile& file, const string& peer) {
+    TRACE_SCOPE("pickPiece");
+    static thread_local mt19937 generator(random_device{}());
+    bool fromServer = peer == "origin";
+    bool stalled = chrono::steady_clock::now() - file.lastProgress > chrono::milliseconds(STALL_TIMEOUT_MS);
+    const string* peerBitfield = fromServer ? NULL : &file.peerPieces[peer];
+
+    int best = -1;
+    int bestHolders = 0;
+    int ties = 0;
+    for (uint32_t i = 0; i < file.pieceChecksums.size(); i++) {
+        if (file.havePieces[i] == '1' || file.requestedPieces[i]) {
+            continue;
+        }
+        if (!fromServer && (peerBitfield->size() <= i || (*peerBitfield)[i] != '1')) {
+            continue;
+        }
+        int holders = 0;
+        for (const auto& other : file.peerPieces) {
+            if (other.second.size() > i && other.second[i] == '1' && file.failedPeers.count(other.first) == 0) {
+                holders++;
+            }
+        }
+        if (fromServer && (holders > 0 || (i % file.originCount != file.originIndex && !stalled))) {
+            continue;
+        }
 
-            downloadQueue.erase(remove_if(downloadQueue.begin(), downloadQueue.end(),
-                [&fileName](const auto& entry) { return entry.first == fileName; }),
-                downloadQueue.end());
+        // Rarest first, ties broken at random so peers do not all chase the same piece
+        if (best == -1 || holders < bestHolders) {
+            best = i;
+            bestHolders = holders;
+            ties = 1;
+        }
+        else if (holders == bestHolders && generator() % ++ties == 0) {
+            best = i;
         }
     }
+    return best;
 }
 
-void downloadFiles(SOCKET sock) {
+// Connect to the server or a peer and do the name handshake
+SOCKET connectToPeer(const string& peer) {
+    sockaddr_in address = serverAddress;
+    if (peer != "origin") {
+        size_t colon = peer.find(":");
+        if (colon == string::npos || inet_pton(AF_INET, peer.substr(0, colon).c_str(), &address.sin_addr) <= 0) {
+            return INVALID_SOCKET;
+        }
+        address.sin_port = htons(atoi(peer.substr(colon + 1).c_str()));
+    }
+
+    SOCKET sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (sock == INVALID_SOCKET || connect(sock, (sockaddr*)&address, sizeof(address)) == SOCKET_ERROR) {
+        closesocket(sock);
+        return INVALID_SOCKET;
+    }
+    configureTransferSocket(sock);
+
+    // Peers answer with a file list of their own, like the server does
+    string name = "peer:" + to_string(peerPort);
+    string fileListStr;
+    if (!sendAll(sock, name.c_str(), name.size()) || !recvFileList(sock, fileListStr)) {
+        closesocket(sock);
+        return INVALID_SOCKET;
+    }
+    return sock;
+}
+
+// Fetch one piece over an open connection and check it against the tracker's checksum
+bool fetchPiece(SOCKET sock, const SwarmFile& file, uint32_t piece, vector<char>& data) {
+    TRACE_SCOPE("fetchPiece");
+    uint32_t offset = piece * PIECE_SIZE;
+    uint32_t length = min((uint32_t)PIECE_SIZE, file.fileSize - offset);
+    string dataToSend = file.fileName + "|NORMAL|" + to_string(offset) + "|" + to_string(file.fileSize) + "|" + to_string(length);
+    uint32_t request[4] = { htonl(1), htonl(0), htonl(piece), htonl(dataToSend.size()) };
+    if (!sendAll(sock, (char*)request, sizeof(request)) || !sendAll(sock, dataToSend.c_str(), dataToSend.size())) {
+        return false;
+    }
+
+    // A size frame first (a different size means the peer cannot serve this piece), then the data
+    uint32_t header[3];
+    if (!recvAll(sock, (char*)header, sizeof(header)) || ntohl(header[0]) != FRAME_SIZE || ntohl(header[2]) != file.fileSize) {
+        return false;
+    }
+    data.resize(length);
+    uint32_t received = 0;
+    while (received < length) {
+        if (!recvAll(sock, (char*)header, sizeof(header)) || ntohl(header[0]) != FRAME_DATA ||
+            ntohl(header[1]) != piece || ntohl(header[2]) > length - received ||
+            !recvAll(sock, data.data() + received, ntohl(header[2]))) {
+            return false;
+        }
+        received += ntohl(header[2]);
+    }
+    return crc32(data.data(), length) == file.pieceChecksums[piece];
+}
+
+// Keep fetching pieces of one file from one peer (or the server) until the file is complete
+void fetchPieces(shared_ptr<SwarmFile> file, string peer) {
+    SOCKET sock = connectToPeer(peer);
+    fstream outFile("output/" + file->fileName, ios::binary | ios::in | ios::out);
+    vector<char> data;
+    bool failed = sock == INVALID_SOCKET || !outFile;
+
+    while (!failed) {
+        int piece;
+        {
+            lock_guard<mutex> lock(swarmMutex);
+            if (file->havePieces.find('0') == string::npos) {
+                break;
+            }
+            piece = pickPiece(*file, peer);
+            if (piece != -1) {
+                file->requestedPieces[piece] = true;
+            }
+        }
+        if (piece == -1) {
+            this_thread::sleep_for(chrono::milliseconds(ANNOUNCE_INTERVAL_MS / 5));
+            continue;
+        }
+
+        failed = !fetchPiece(sock, *file, piece, data);
+        if (!failed) {
+            outFile.seekp((streamoff)piece * PIECE_SIZE);
+            outFile.write(data.data(), data.size());
+            outFile.flush();
+            failed = !outFile.good();
+        }
+
+        lock_guard<mutex> lock(swarmMutex);
+        file->requestedPieces[piece] = false;
+        if (!failed) {
+            file->havePieces[piece] = '1';
+            file->lastProgress = chrono::steady_clock::now();
+            (peer == "origin" ? file->bytesFromServer : file->bytesFromPeers) += data.size();
+
+            uint32_t percentage = count(file->havePieces.begin(), file->havePieces.end(), '1') * 100 / file->havePieces.size();
+            if (percentage != file->lastPercentage) {
+                cout << "Downloading " << file->fileName << "...." << percentage << "% complete" << endl;
+                file->lastPercentage = percentage;
+            }
+        }
+    }
+
+    if (sock != INVALID_SOCKET) {
+        closesocket(sock);
+    }
+    lock_guard<mutex> lock(swarmMutex);
+    if (failed) {
+        cerr << "Transfer of " << file->fileName << " from " << peer << " failed\n";
+        if (peer != "origin") {
+            file->failedPeers.insert(peer);
+        }
+    }
+    file->activeFetchers.erase(peer);
+}
+
+// Tell the tracker which pieces we have, the reply refreshes the peer list
+bool announcePieces(SOCKET sock, const shared_ptr<SwarmFile>& file) {
+    string dataToSend;
+    {
+        lock_guard<mutex> lock(swarmMutex);
+        dataToSend = file->fileName + "|" + to_string(peerPort) + "|" + file->havePieces;
+    }
+    uint32_t request[4] = { htonl(1), htonl(BATCH_ANNOUNCE), htonl(file->id), htonl(dataToSend.size()) };
+    string batch((char*)request, sizeof(request));
+    batch += dataToSend;
+
+    lock_guard<mutex> lock(downloadQueueMutex); // The scanner sends on this socket as well
+    return sendAll(sock, batch.c_str(), batch.size());
+}
+
+// Drive the download of one file: reuse verified pieces already on disk, keep a fetch thread
+// running for the server and every peer, and announce progress until every piece is in.
+void runSwarmDownload(SOCKET sock, shared_ptr<SwarmFile> file) {
+    string path = "output/" + file->fileName;
+    string havePieces(file->pieceChecksums.size(), '0');
+    error_code error;
+    if (filesystem::file_size(path, error) == file->fileSize && !error) {
+        ifstream existing(path, ios::binary);
+        vector<char> data(PIECE_SIZE);
+        for (size_t i = 0; i < havePieces.size(); i++) {
+            existing.read(data.data(), data.size());
+            if (crc32(data.data(), existing.gcount()) == file->pieceChecksums[i]) {
+                havePieces[i] = '1';
+            }
+        }
+    }
+    else {
+        ofstream(path, ios::binary | ios::trunc).close();
+        filesystem::resize_file(path, file->fileSize, error);
+    }
+
+    {
+        lock_guard<mutex> lock(swarmMutex);
+        file->havePieces = havePieces;
+        file->lastProgress = chrono::steady_clock::now();
+    }
+
+    while (true) {
+        {
+            lock_guard<mutex> lock(swarmMutex);
+            if (file->havePieces.find('0') == string::npos) {
+                break;
+            }
+            vector<string> peers = { "origin" };
+            for (const auto& peer : file->peerPieces) {
+                peers.push_back(peer.first);
+            }
+            for (const auto& peer : peers) {
+                if (file->failedPeers.count(peer) == 0 && file->activeFetchers.insert(peer).second) {
+                    thread fetcher(fetchPieces, file, peer);
+                    fetcher.detach();
+                }
+            }
+        }
+        if (!announcePieces(sock, file)) {
+            cerr << "Error announcing " << file->fileName << endl;
+            return;
+        }
+        this_thread::sleep_for(chrono::milliseconds(ANNOUNCE_INTERVAL_MS));
+    }
+
+    // Every piece was verified on arrival, the checksum of the whole file is only for the state store
+    uint32_t checksum = 0;
+    ifstream complete(path, ios::binary);
+    vector<char> data(PIECE_SIZE);
+    while (complete.read(data.data(), data.size()) || complete.gcount() > 0) {
+        checksum = crc32(data.data(), complete.gcount(), checksum);
+    }
+    cout << file->fileName << ": " << file->bytesFromPeers << " bytes from peers, " << file->bytesFromServer << " bytes from the server\n";
+
+    // The last announce makes us a seed for this file
+    announcePieces(sock, file);
+    lock_guard<mutex> lock(downloadQueueMutex);
+    Download* download = downloadQueue.findRequest(file->id);
+    if (download) {
+        recordDownloadedFile(*download, file->fileSize, checksum);
+    }
+    downloadQueue.finishRequest(file->id);
+    if (!requestQueuedFiles(sock)) {
+        cerr << "Error sending file requests\n";
+    }
+}
+
+// Apply a tracker reply (see server2.cpp for the format), the first one starts the download
+void handleTrackerReply(SOCKET sock, uint32_t id, const string& reply) {
+    TRACE_SCOPE("handleTrackerReply");
+    istringstream lines(reply);
+    string line, fileName;
+    uint32_t fileSize = 0;
+    uint32_t originIndex = 0, originCount = 1;
+    vector<uint32_t> pieceChecksums;
+    map<string, string> peerPieces;
+    while (getline(lines, line)) {
+        istringstream fields(line);
+        string key;
+        fields >> key;
+        if (key == "file") {
+            getline(fields >> ws, fileName);
+        }
+        else if (key == "size") {
+            fields >> fileSize;
+        }
+        else if (key == "pieces") {
+            uint32_t checksum;
+            while (fields >> hex >> checksum) {
+                pieceChecksums.push_back(checksum);
+            }
+        }
+        else if (key == "origin") {
+            fields >> originIndex >> originCount;
+        }
+        else if (key == "peer") {
+            string address, bitfield;
+            fields >> address >> bitfield;
+            peerPieces[address] = bitfield;
+        }
+    }
+
+    bool notFound = fileSize == 0 || pieceChecksums.size() != (fileSize + PIECE_SIZE - 1) / PIECE_SIZE;
+    shared_ptr<SwarmFile> started;
+    {
+        lock_guard<mutex> lock(swarmMutex);
+        auto it = swarmFiles.find(fileName);
+        if (it != swarmFiles.end()) {
+            it->second->peerPieces = peerPieces;
+            it->second->originIndex = originIndex;
+            it->second->originCount = max(originCount, (uint32_t)1);
+            return;
+        }
+        if (!notFound) {
+            started = make_shared<SwarmFile>();
+            started->fileName = fileName;
+            started->id = id;
+            started->fileSize = fileSize;
+            started->pieceChecksums = pieceChecksums;
+            started->havePieces = string(pieceChecksums.size(), '0');
+            started->requestedPieces.assign(pieceChecksums.size(), false);
+            started->peerPieces = peerPieces;
+            started->originIndex = originIndex;
+            started->originCount = max(originCount, (uint32_t)1);
+            swarmFiles[fileName] = started;
+        }
+    }
+
+    if (started) {
+        cout << "Receive " << fileName << " with size of " << fileSize << " from " << peerPieces.size() << " peers and the server" << endl;
+        thread downloader(runSwarmDownload, sock, started);
+        downloader.detach();
+        return;
+    }
+
+    cerr << "File " << fileName << " not found on server or empty\n";
+    lock_guard<mutex> lock(downloadQueueMutex);
+    Download* download = downloadQueue.findRequest(id);
+    if (download) {
+        recordDownloadedFile(*download, 0, 0);
+    }
+    downloadQueue.finishRequest(id);
+    if (!requestQueuedFiles(sock)) {
+        cerr << "Error sending file requests\n";
+    }
+}
+
+// Answer piece requests of one peer, only pieces we verified are served
+void servePeer(SOCKET peerSocket) {
+    char buffer[MAX_REQUEST_LENGTH];
+    if (recv(peerSocket, buffer, MAX_REQUEST_LENGTH, 0) <= 0 || !sendFileList(peerSocket, "swarm peer\n")) {
+        closesocket(peerSocket);
+        return;
+    }
+    configureTransferSocket(peerSocket);
+
+    vector<char> chunkBuffer(BUFFER_SIZE);
     while (true) {
-        vector<pair<string, string>> filesToDownload;
+        uint32_t request[4];
+        if (!recvAll(peerSocket, (char*)request, sizeof(request)) || ntohl(request[0]) != 1 ||
+            ntohl(request[3]) == 0 || ntohl(request[3]) > MAX_REQUEST_LENGTH) {
+            break;
+        }
+        uint32_t id = ntohl(request[2]);
+        string dataReceived(ntohl(request[3]), '\0');
+        if (!recvAll(peerSocket, &dataReceived[0], dataReceived.size())) {
+            break;
+        }
+
+        FileRequestFields fields;
+        splitFileRequest(dataReceived, fields);
+        const string& fileName = fields.fileName;
+        uint32_t offset = fields.offset;
+        uint32_t expectedSize = fields.expectedSize;
+        uint32_t length = fields.length;
 
+        uint32_t fileSize = 0;
         {
-            lock_guard<mutex> lock(downloadQueueMutex);
-            filesToDownload = downloadQueue;
+            lock_guard<mutex> lock(swarmMutex);
+            auto it = swarmFiles.find(fileName);
+            uint32_t piece = offset / PIECE_SIZE;
+            if (it != swarmFiles.end() && it->second->fileSize == expectedSize && offset % PIECE_SIZE == 0 &&
+                piece < it->second->havePieces.size() && it->second->havePieces[piece] == '1' &&
+                length == min((uint32_t)PIECE_SIZE, expectedSize - offset)) {
+                fileSize = expectedSize;
+            }
         }
 
-        if (filesToDownload.empty()) {
-            this_thread::sleep_for(chrono::seconds(2));
+        if (!sendFrame(peerSocket, FRAME_SIZE, id, fileSize, NULL, 0)) {
+            break;
+        }
+        if (fileSize == 0) {
             continue;
         }
 
-        uint32_t numFiles = filesToDownload.size();
-        numFiles = htonl(numFiles);
-        int sendResult = send(sock, (char*)&numFiles, sizeof(numFiles), 0);
-        if (sendResult == SOCKET_ERROR) {
-            cerr << "Error sending number of files\n";
+        ifstream inFile("output/" + fileName, ios::binary);
+        inFile.seekg(offset);
+        bool sent = true;
+        while (sent && length > 0) {
+            uint32_t bytesRead;
+            sent = sendFileChunk(peerSocket, id, inFile, chunkBuffer.data(), min((uint32_t)BUFFER_SIZE, length), bytesRead) && bytesRead > 0;
+            length -= bytesRead;
+        }
+        if (!sent) {
+            break;
+        }
+    }
+    closesocket(peerSocket);
+}
+
+void acceptPeers(SOCKET listenSocket) {
+    while (true) {
+        SOCKET peerSocket = accept(listenSocket, NULL, NULL);
+        if (peerSocket == INVALID_SOCKET) {
+            cerr << "Accept failed: " << WSAGetLastError() << endl;
+            return;
+        }
+        thread peerThread(servePeer, peerSocket);
+        peerThread.detach();
+    }
+}
+
+// Only this thread reads from the socket: the server interleaves frames of every
+// in-flight file, each frame tagged with the id of the request it answers.
+void downloadFiles(SOCKET sock) {
+    while (true) {
+        uint32_t header[3];
+        if (!recvAll(sock, (char*)header, sizeof(header))) {
+            cerr << "Connection to server lost\n";
             return;
         }
+        uint32_t type = ntohl(header[0]);
+        uint32_t id = ntohl(header[1]);
+        uint32_t value = ntohl(header[2]);
 
-        // Send file name and priority with a delimiter
-        for (const auto& file : filesToDownload) {
-            string dataToSend = file.first + "|" + file.second;
-            send(sock, dataToSend.c_str(), dataToSend.size(), 0);
+        if (type == FRAME_BUNDLE) {
+            if (!downloadBundle(sock, value)) {
+                return;
+            }
+            continue;
         }
 
-        for (const auto& file : filesToDownload) {
-            if (fileSizes.find(file.first) == fileSizes.end()) {
-                uint32_t fileSize;
-                int receiveResult = recv(sock, (char*)&fileSize, sizeof(fileSize), 0);
-                if (receiveResult <= 0) {
-                    cerr << "Error receiving size of " << file.first << endl;
-                    break;
-                }
-                fileSize = ntohl(fileSize);
-                cout << "Receive " << file.first << " with size of " << fileSize << endl;
-                fileSizes[file.first] = fileSize;
-                bytesReceived[file.first] = 0;
-                lastPercentage[file.first] = 0;
+        if (type == FRAME_PEERS) {
+            string reply(value, '\0');
+            if (value > 0 && !recvAll(sock, &reply[0], value)) {
+                cerr << "Error receiving tracker reply\n";
+                return;
             }
+            handleTrackerReply(sock, id, reply);
+            continue;
         }
 
-        // Concurrently download the files
-        vector<thread> downloadThreads;
-        for (const auto& file : filesToDownload) {
-            downloadThreads.emplace_back([&, file]() {
-                downloadFileChunk(sock, file.first, priorities[file.second]);
-                });
+        // The record stays put while the request is in flight, only this thread finishes it
+        Download* download;
+        uint32_t resumeOffset;
+        {
+            lock_guard<mutex> lock(downloadQueueMutex);
+            download = downloadQueue.findRequest(id);
+            if (!download) {
+                cerr << "Received data for unknown request " << id << endl;
+                return;
+            }
+            resumeOffset = download->resumeOffset;
         }
+        const string& fileName = download->fileName;
+
+        if (type == FRAME_SIZE) {
+            cout << "Receive " << fileName << " with size of " << value << endl;
+            download->fileSize = value;
+            download->bytesReceived = 0;
+            download->lastPercentage = 0;
+            download->checksum = 0;
+            download->writeFailed = false;
+
+            // The server resumes exactly when the size still matches what we recorded
+            DownloadRecord record;
+            bool resuming = resumeOffset > 0 && downloadState.find(fileName, record) &&
+                record.size == value && record.offset == resumeOffset;
+
+            if (resuming) {
+                // Drop whatever was written after the last checkpoint, chunks are appended from there
+                error_code error;
+                filesystem::resize_file("output/" + fileName, record.offset, error);
+                download->bytesReceived = record.offset;
+                download->checksum = record.checksum;
+                cout << "Resuming " << fileName << " from byte " << record.offset << endl;
+            }
+            else {
+                // Start from an empty file, chunks are appended as they arrive
+                ofstream outFile("output/" + fileName, ios::binary | ios::trunc);
+            }
 
-        for (auto& thread : downloadThreads) {
-            if (thread.joinable()) {
-                thread.join();
+            if (value == 0) {
+                cerr << "File " << fileName << " not found on server or empty\n";
+                finishDownload(sock, *download);
             }
         }
+        else if (type == FRAME_DATA) {
+            if (!downloadFileChunk(sock, *download, value)) {
+                return;
+            }
+        }
+        else if (type == FRAME_FAILED) {
+            // Not recorded, the next scan requests it again and resumes from the last checkpoint
+            cerr << "Server could not read " << fileName << ", it will be requested again\n";
+            lock_guard<mutex> lock(downloadQueueMutex);
+            downloadQueue.finishRequest(id);
+            if (!requestQueuedFiles(sock)) {
+                cerr << "Error sending file requests\n";
+            }
+        }
+        else {
+            cerr << "Unknown frame type " << type << " from server\n";
+            return;
+        }
     }
 }
 
 void scanInputFile(SOCKET sock) {
     while (true) {
-        vector<pair<string, string>> filesToDownload = readFileList(INPUT_FILE, downloadedFiles);
+        vector<pair<string, string>> filesToDownload = readFileList(INPUT_FILE, downloadState);
 
-        for (const auto& file : filesToDownload) {
+        {
+            TRACE_SCOPE("scanInputFile");
             lock_guard<mutex> lock(downloadQueueMutex);
-            if (completedFiles.find(file.first) == completedFiles.end() &&
-                find_if(downloadQueue.begin(), downloadQueue.end(), [&file](const auto& entry) {
-                    return entry.first == file.first;
-                    }) == downloadQueue.end()) {
-                downloadQueue.push_back(file);
-                cout << "Added to download queue: " << file.first << endl;
+            for (const auto& file : filesToDownload) {
+                Download& download = downloadQueue.intern(file.first);
+                if (downloadQueue.push(download, file.second, priorityValue(file.second))) {
+                    cout << "Added to download queue: " << file.first << endl;
+                }
+            }
+
+            // Only new files are sent, and only as many as the window allows
+            if (!requestQueuedFiles(sock)) {
+                cerr << "Error sending file requests\n";
+                return;
             }
         }
 
@@ -212,10 +824,20 @@ void scanInputFile(SOCKET sock) {
 }
 void signal_callback_handler(int signum) {
     cout << "Exit..." << endl;
+    TRACE_FLUSH();
     exit(signum);
 }
-int main() {
+int main(int argc, char* argv[]) {
     signal(SIGINT, signal_callback_handler);
+
+    if (argc > 1 && atoi(argv[1]) > 0) {
+        pipelineWindow = atoi(argv[1]);
+    }
+    // A peer port as second argument turns on swarm mode
+    if (argc > 2 && atoi(argv[2]) > 0) {
+        peerPort = atoi(argv[2]);
+    }
+
     WSADATA wsaData;
     int result;
 
@@ -246,19 +868,47 @@ int main() {
         return -1;
     }
 
+    configureTransferSocket(sock);
+    serverAddress = serv_addr;
+
+    if (peerPort != 0) {
+        SOCKET listenSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        sockaddr_in peerAddress;
+        peerAddress.sin_family = AF_INET;
+        peerAddress.sin_addr.s_addr = htonl(INADDR_ANY);
+        peerAddress.sin_port = htons(peerPort);
+        if (listenSocket == INVALID_SOCKET || bind(listenSocket, (sockaddr*)&peerAddress, sizeof(peerAddress)) == SOCKET_ERROR ||
+            listen(listenSocket, SOMAXCONN) == SOCKET_ERROR) {
+            cerr << "Unable to listen for peers on port " << peerPort << endl;
+            closesocket(sock);
+            WSACleanup();
+            return 1;
+        }
+        thread peerListener(acceptPeers, listenSocket);
+        peerListener.detach();
+        cout << "Swarm mode, serving peers on port " << peerPort << endl;
+    }
+
     string clientName;
     cout << "Enter your name: ";
     getline(cin, clientName);
 
     send(sock, clientName.c_str(), clientName.size(), 0);
 
-    char buffer[BUFFER_SIZE] = { 0 };
-    int valread = recv(sock, buffer, BUFFER_SIZE, 0);
-    if (valread > 0) {
-        cout << "Available files:\n" << string(buffer, valread) << endl;
+    string fileListStr;
+    if (!recvFileList(sock, fileListStr)) {
+        cerr << "Error receiving file list" << endl;
+        closesocket(sock);
+        WSACleanup();
+        return 1;
     }
+    cout << "Available files:\n" << fileListStr << endl;
 
-    downloadedFiles = readDownloadedFiles();
+    if (!downloadState.open(DOWNLOAD_STATE_FILE, DOWNLOADED_FILE_LIST)) {
+        closesocket(sock);
+        WSACleanup();
+        return 1;
+    }
 
     thread inputScanner(scanInputFile, sock);
     inputScanner.detach();
@@ -267,5 +917,6 @@ int main() {
 
     closesocket(sock);
     WSACleanup();
+    TRACE_FLUSH();
     return 0;
 }
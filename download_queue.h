@@ -0,0 +1,134 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <deque>
+#include <queue>
+#include <unordered_map>
+
+// Download bookkeeping of client2.cpp.
+//
+// Every file name seen in input.txt is interned once: it gets a file id and one Download record
+// that holds everything about it, from the queue state to the bytes received so far, so the
+// receiving thread touches a single record per chunk instead of looking the name up in several
+// maps. Records live in a deque, which never moves them, so a reference taken under the queue
+// mutex stays valid while the scanner interns new files. Waiting files sit in a binary heap
+// ordered by priority and then by arrival, in-flight files in a hash map by request id:
+//   intern / duplicate check   O(1)
+//   enqueue / dequeue          O(log n)
+//   request id lookup          O(1)
+// The status of the record is the duplicate check, a file is in the heap at most once.
+
+enum DownloadStatus {
+    DOWNLOAD_IDLE,      // Known, not queued: new, or its last transfer failed
+    DOWNLOAD_QUEUED,
+    DOWNLOAD_IN_FLIGHT,
+    DOWNLOAD_COMPLETE
+};
+
+struct Download {
+    uint32_t fileId;
+    std::string fileName;
+    std::string priority;      // As written in input.txt, sent with the request
+    DownloadStatus status = DOWNLOAD_IDLE;
+    uint32_t requestId = 0;    // Request the file is in flight under
+    uint32_t resumeOffset = 0; // Offset sent with the request when resuming, 0 otherwise
+    // Only the receiving thread uses the fields below
+    uint32_t fileSize = 0;
+    uint32_t bytesReceived = 0;
+    uint32_t checksum = 0;     // CRC-32 of the bytes received so far
+    uint32_t lastPercentage = 0;
+    bool writeFailed = false;  // output/ could not be written, the rest of the transfer is dropped
+};
+
+// Not thread safe, client2.cpp guards it with downloadQueueMutex
+class DownloadQueue {
+public:
+    // The record of `fileName`, created on first sight
+    Download& intern(const std::string& fileName) {
+        auto it = fileIds.find(fileName);
+        if (it != fileIds.end()) {
+            return downloads[it->second];
+        }
+        uint32_t fileId = (uint32_t)downloads.size();
+        fileIds.emplace(fileName, fileId);
+        downloads.push_back(Download());
+        downloads.back().fileId = fileId;
+        downloads.back().fileName = fileName;
+        return downloads.back();
+    }
+
+    // Queue an idle file, returns false if it is already queued, in flight or complete
+    bool push(Download& download, const std::string& priority, int priorityValue) {
+        if (download.status != DOWNLOAD_IDLE) {
+            return false;
+        }
+        download.status = DOWNLOAD_QUEUED;
+        download.priority = priority;
+        waiting.push({ priorityValue, nextSequence++, download.fileId });
+        return true;
+    }
+
+    bool empty() const {
+        return waiting.empty();
+    }
+
+    // Move the highest priority file (the oldest of equal ones) into flight under `requestId`
+    Download& pop(uint32_t requestId) {
+        Download& download = downloads[waiting.top().fileId];
+        waiting.pop();
+        download.status = DOWNLOAD_IN_FLIGHT;
+        download.requestId = requestId;
+        inFlight[requestId] = download.fileId;
+        return download;
+    }
+
+    // The in-flight file of `requestId`, NULL if there is none
+    Download* findRequest(uint32_t requestId) {
+        auto it = inFlight.find(requestId);
+        return it != inFlight.end() ? &downloads[it->second] : NULL;
+    }
+
+    // The request is over, a file that did not complete becomes idle and is queued again by the next scan
+    void finishRequest(uint32_t requestId) {
+        auto it = inFlight.find(requestId);
+        if (it == inFlight.end()) {
+            return;
+        }
+        Download& download = downloads[it->second];
+        if (download.status == DOWNLOAD_IN_FLIGHT) {
+            download.status = DOWNLOAD_IDLE;
+        }
+        inFlight.erase(it);
+    }
+
+    size_t waitingCount() const {
+        return waiting.size();
+    }
+
+    size_t inFlightCount() const {
+        return inFlight.size();
+    }
+
+private:
+    struct QueueEntry {
+        int priorityValue;
+        uint64_t sequence;
+        uint32_t fileId;
+
+        // priority_queue puts the largest on top: highest priority, then lowest sequence
+        bool operator<(const QueueEntry& other) const {
+            if (priorityValue != other.priorityValue) {
+                return priorityValue < other.priorityValue;
+            }
+            return sequence > other.sequence;
+        }
+    };
+
+    std::unordered_map<std::string, uint32_t> fileIds;
+    std::deque<Download> downloads; // Indexed by file id
+    std::priority_queue<QueueEntry> waiting;
+    std::unordered_map<uint32_t, uint32_t> inFlight; // Request id -> file id
+    uint64_t nextSequence = 0;
+};
@@ -0,0 +1,354 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <unordered_map>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <condition_variable>
+#include <filesystem>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// Download state shared by client.cpp and client2.cpp, and the cache index of server2.cpp.
+//
+// The state lives in an append-only binary log, every update appends one record:
+//   uint32 body length, uint32 CRC-32 of the body, then the body:
+//   uint8 complete (2 if the file was erased), uint64 size, uint64 offset, uint32 checksum,
+//   int64 modified time, file name
+// On startup the whole log is read with one read and replayed into a hash map, later records
+// win and an erase record removes the entry. A torn or corrupt tail (crash in the middle of a write) ends the replay and is dropped
+// by compacting right away. The log is compacted again whenever it holds far more records
+// than live entries, by writing a fresh log next to it and renaming it over the old one.
+// Records are handed to the OS as they are written and synced to disk by a background thread,
+// all records of one SYNC_INTERVAL_MS together, so no caller waits for the disk. A power loss
+// drops at most the records of the last interval, replay treats them like any torn tail.
+// A compacted log is synced before it replaces the old one.
+
+#define DOWNLOAD_STATE_FILE "downloads.db"
+#define COMPACT_MIN_RECORDS 1024 // Never compact a log smaller than this
+#define SYNC_INTERVAL_MS 100     // Records written within this long are synced together
+
+inline std::vector<uint32_t> buildCrcTable() {
+    std::vector<uint32_t> table(256);
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) {
+            c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+        }
+        table[i] = c;
+    }
+    return table;
+}
+
+// Standard CRC-32, pass the previous result as `crc` to continue over several pieces
+inline uint32_t crc32(const char* data, size_t length, uint32_t crc = 0) {
+    static const std::vector<uint32_t> table = buildCrcTable();
+
+    crc = ~crc;
+    for (size_t i = 0; i < length; i++) {
+        crc = table[(crc ^ (unsigned char)data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+// fflush only hands the data to the OS, this waits until it is on the disk
+inline bool syncFile(FILE* file) {
+    if (fflush(file) != 0) {
+        return false;
+    }
+#ifdef _WIN32
+    return _commit(_fileno(file)) == 0;
+#else
+    return fsync(fileno(file)) == 0;
+#endif
+}
+
+struct DownloadRecord {
+    bool complete;
+    uint64_t size;         // Size of the file on the server, 0 if unknown
+    uint64_t offset;       // Bytes already written to the data directory, equals size once complete
+    uint32_t checksum;     // CRC-32 of the first `offset` bytes
+    int64_t modifiedTime;  // Last write time of the file when the record was written
+};
+
+class DownloadStateStore {
+public:
+    // `dataDirectory` holds the files the records describe ("output" for the clients)
+    explicit DownloadStateStore(const std::string& dataDirectory) : dataDirectory(dataDirectory) {}
+
+    ~DownloadStateStore() {
+        {
+            std::lock_guard<std::mutex> lock(storeMutex);
+            stopSyncing = true;
+        }
+        syncRequested.notify_one();
+        if (syncThread.joinable()) {
+            syncThread.join();
+        }
+        if (log) {
+            syncFile(log);
+            fclose(log);
+        }
+    }
+
+    // Load the log, importing the old downloaded_files.txt list the first time
+    bool open(const std::string& logPath, const std::string& legacyListPath) {
+        std::lock_guard<std::mutex> lock(storeMutex);
+        path = logPath;
+
+        bool needsCompaction = false;
+        std::ifstream file(path, std::ios::binary | std::ios::ate);
+        if (file.is_open()) {
+            std::vector<char> data((size_t)file.tellg());
+            file.seekg(0, std::ios::beg);
+            file.read(data.data(), data.size());
+            needsCompaction = !replay(data);
+        }
+        else {
+            std::ifstream legacyList(legacyListPath);
+            std::string line;
+            while (std::getline(legacyList, line)) {
+                if (!line.empty()) {
+                    records[line] = { true, 0, 0, 0, 0 };
+                }
+            }
+            needsCompaction = true;
+        }
+
+        if (needsCompaction && !compact()) {
+            return false;
+        }
+        if (!log) {
+            log = fopen(path.c_str(), "ab");
+        }
+        if (!log) {
+            std::cerr << "Unable to open file: " << path << std::endl;
+            return false;
+        }
+        if (!syncThread.joinable()) {
+            syncThread = std::thread(&DownloadStateStore::syncLoop, this);
+        }
+        return true;
+    }
+
+    bool find(const std::string& fileName, DownloadRecord& record) {
+        std::lock_guard<std::mutex> lock(storeMutex);
+        auto it = records.find(fileName);
+        if (it == records.end()) {
+            return false;
+        }
+        record = it->second;
+        return true;
+    }
+
+    bool isComplete(const std::string& fileName) {
+        std::lock_guard<std::mutex> lock(storeMutex);
+        auto it = records.find(fileName);
+        return it != records.end() && it->second.complete;
+    }
+
+    void markComplete(const std::string& fileName, uint64_t size, uint32_t checksum) {
+        put(fileName, { true, size, size, checksum, modifiedTime(fileName) });
+    }
+
+    // Remember how far a download got so it can resume from there
+    void savePartial(const std::string& fileName, uint64_t size, uint64_t offset, uint32_t checksum) {
+        put(fileName, { false, size, offset, checksum, modifiedTime(fileName) });
+    }
+
+    // Forget a file, compaction then leaves it out of the log
+    void erase(const std::string& fileName) {
+        std::lock_guard<std::mutex> lock(storeMutex);
+        if (records.erase(fileName) > 0) {
+            append(encode(fileName, { false, 0, 0, 0, 0 }, true));
+        }
+    }
+
+    size_t size() {
+        std::lock_guard<std::mutex> lock(storeMutex);
+        return records.size();
+    }
+
+private:
+    int64_t modifiedTime(const std::string& fileName) const {
+        std::error_code error;
+        auto modified = std::filesystem::last_write_time(dataDirectory + "/" + fileName, error);
+        return error ? 0 : (int64_t)modified.time_since_epoch().count();
+    }
+
+    static std::string encode(const std::string& fileName, const DownloadRecord& record, bool erased = false) {
+        std::string body;
+        uint8_t complete = erased ? 2 : record.complete ? 1 : 0;
+        body.append((char*)&complete, sizeof(complete));
+        body.append((char*)&record.size, sizeof(record.size));
+        body.append((char*)&record.offset, sizeof(record.offset));
+        body.append((char*)&record.checksum, sizeof(record.checksum));
+        body.append((char*)&record.modifiedTime, sizeof(record.modifiedTime));
+        body.append(fileName);
+
+        uint32_t header[2] = { (uint32_t)body.size(), crc32(body.data(), body.size()) };
+        return std::string((char*)header, sizeof(header)) + body;
+    }
+
+    // Returns false if the log ended in a torn or corrupt record
+    bool replay(const std::vector<char>& data) {
+        const size_t fixedLength = 1 + 8 + 8 + 4 + 8;
+        size_t pos = 0;
+        while (pos < data.size()) {
+            uint32_t header[2];
+            if (data.size() - pos < sizeof(header)) {
+                return false;
+            }
+            memcpy(header, &data[pos], sizeof(header));
+            const char* body = &data[pos + sizeof(header)];
+            if (header[0] < fixedLength || data.size() - pos - sizeof(header) < header[0] || crc32(body, header[0]) != header[1]) {
+                return false;
+            }
+
+            std::string fileName(body + fixedLength, header[0] - fixedLength);
+            if (body[0] == 2) {
+                records.erase(fileName);
+            }
+            else {
+                DownloadRecord record;
+                record.complete = body[0] != 0;
+                memcpy(&record.size, body + 1, 8);
+                memcpy(&record.offset, body + 9, 8);
+                memcpy(&record.checksum, body + 17, 4);
+                memcpy(&record.modifiedTime, body + 21, 8);
+                records[fileName] = record;
+            }
+
+            pos += sizeof(header) + header[0];
+            appendedRecords++;
+        }
+        return true;
+    }
+
+    void put(const std::string& fileName, const DownloadRecord& record) {
+        std::lock_guard<std::mutex> lock(storeMutex);
+        records[fileName] = record;
+        append(encode(fileName, record));
+    }
+
+    // Append one encoded record and compact if the log got too long, caller must hold storeMutex.
+    // The record only reaches the OS here, syncLoop puts it on the disk.
+    void append(const std::string& encoded) {
+        if (!log || fwrite(encoded.data(), 1, encoded.size(), log) != encoded.size() || fflush(log) != 0) {
+            std::cerr << "Unable to write to file: " << path << std::endl;
+            return;
+        }
+        if (!unsynced) {
+            unsynced = true;
+            syncRequested.notify_one();
+        }
+
+        if (++appendedRecords > 2 * records.size() + COMPACT_MIN_RECORDS) {
+            compact();
+        }
+    }
+
+    // Write only the live records to a new log and swap it in, caller must hold storeMutex
+    bool compact() {
+        std::string tempPath = path + ".tmp";
+        FILE* temp = fopen(tempPath.c_str(), "wb");
+        if (!temp) {
+            std::cerr << "Unable to open file: " << tempPath << std::endl;
+            return false;
+        }
+
+        std::string encoded;
+        for (const auto& entry : records) {
+            encoded += encode(entry.first, entry.second);
+        }
+        // The new log must be on the disk before it replaces the old one
+        bool written = fwrite(encoded.data(), 1, encoded.size(), temp) == encoded.size() && syncFile(temp);
+        fclose(temp);
+        if (!written) {
+            std::cerr << "Unable to write to file: " << tempPath << std::endl;
+            return false;
+        }
+
+        if (log) {
+            fclose(log);
+            log = NULL;
+        }
+        std::error_code error;
+        std::filesystem::rename(tempPath, path, error); // Replaces the old log in one step
+        if (error) {
+            std::cerr << "Unable to replace " << path << ": " << error.message() << std::endl;
+        }
+#ifndef _WIN32
+        // The rename lives in the directory, records appended to the new log would be lost without it
+        std::string directory = std::filesystem::path(path).parent_path().string();
+        int directoryHandle = ::open(directory.empty() ? "." : directory.c_str(), O_RDONLY);
+        if (directoryHandle >= 0) {
+            fsync(directoryHandle);
+            ::close(directoryHandle);
+        }
+#endif
+        log = fopen(path.c_str(), "ab");
+        appendedRecords = records.size();
+        return !error && log != NULL;
+    }
+
+    // Group commit: waits for a record, lets the rest of the interval's records arrive, then syncs
+    // them with one fsync. The sync runs on a duplicate of the log's descriptor without storeMutex,
+    // so writers keep appending and a compaction may replace the log meanwhile.
+    void syncLoop() {
+        std::unique_lock<std::mutex> lock(storeMutex);
+        while (true) {
+            syncRequested.wait(lock, [this]() { return unsynced || stopSyncing; });
+            syncRequested.wait_for(lock, std::chrono::milliseconds(SYNC_INTERVAL_MS), [this]() { return stopSyncing; });
+            if (stopSyncing) {
+                return; // The destructor syncs what is left
+            }
+            unsynced = false;
+            if (!log) {
+                continue;
+            }
+#ifdef _WIN32
+            int descriptor = _dup(_fileno(log));
+#else
+            int descriptor = dup(fileno(log));
+#endif
+            lock.unlock();
+            bool synced = false;
+            if (descriptor >= 0) {
+#ifdef _WIN32
+                synced = _commit(descriptor) == 0;
+                _close(descriptor);
+#else
+                synced = fsync(descriptor) == 0;
+                ::close(descriptor);
+#endif
+            }
+            if (!synced) {
+                std::cerr << "Unable to sync file: " << path << std::endl;
+            }
+            lock.lock();
+        }
+    }
+
+    std::unordered_map<std::string, DownloadRecord> records;
+    std::string path;
+    std::string dataDirectory;
+    FILE* log = NULL;
+    size_t appendedRecords = 0;
+    std::mutex storeMutex;
+    std::condition_variable syncRequested;
+    std::thread syncThread;
+    bool unsynced = false;    // Records were written since the last sync
+    bool stopSyncing = false;
+};
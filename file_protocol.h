@@ -0,0 +1,132 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <istream>
+#ifndef _WIN32
+#include <arpa/inet.h>
+#endif
+#include "socket_io.h"
+
+// The part 2 protocol shared by server2.cpp, client2.cpp and the benchmarks in bench/: the frames
+// and how they are sent, the file list the server sends after the name, and the request strings
+// of a batch entry.
+
+// Every message the server sends is a frame: uint32 type, uint32 request id, uint32 value
+#define FRAME_SIZE 1 // value is the file size (0 if not found), no payload
+#define FRAME_DATA 2 // value is the payload length, payload follows the header
+#define FRAME_BUNDLE 3 // value is the file count, followed by an index of (request id, size, crc32) per file and the packed file data
+#define FRAME_PEERS 4 // value is the payload length, payload is the tracker reply to one swarm announce
+#define FRAME_FAILED 5 // The file could not be read after its size was sent, the request is over, no payload
+
+#define BATCH_ALLOW_BUNDLE 1 // Request batch flag: small files of this batch may be answered as one bundle
+#define BATCH_ANNOUNCE 2 // Request batch flag: the entries are swarm announces "name|port|pieces", not file requests
+
+#define MAX_FILE_LIST_LENGTH (16 * 1024 * 1024) // A longer file list in a handshake is treated as a broken connection
+
+// Header and payload leave in one gathered send, so they share a segment
+inline bool sendFrame(SOCKET socket, uint32_t type, uint32_t id, uint32_t value, const char* payload, uint32_t payloadLength) {
+    uint32_t header[3] = { htonl(type), htonl(id), htonl(value) };
+#ifdef _WIN32
+    WSABUF buffers[2] = { { sizeof(header), (char*)header }, { payloadLength, (char*)payload } };
+    DWORD sent = 0;
+    if (WSASend(socket, buffers, payloadLength > 0 ? 2 : 1, &sent, 0, NULL, NULL) == SOCKET_ERROR) {
+        return false;
+    }
+#else
+    iovec buffers[2] = { { header, sizeof(header) }, { (void*)payload, payloadLength } };
+    ssize_t sent = writev(socket, buffers, payloadLength > 0 ? 2 : 1);
+    if (sent < 0) {
+        return false;
+    }
+#endif
+    // A blocking socket normally takes everything at once, finish a partial send the simple way
+    if ((size_t)sent < sizeof(header)) {
+        return sendAll(socket, (char*)header + sent, (int)(sizeof(header) - sent)) && sendAll(socket, payload, payloadLength);
+    }
+    return sendAll(socket, payload + (sent - sizeof(header)), (int)(payloadLength - (sent - sizeof(header))));
+}
+
+// Read up to `length` bytes at the current position of `file` into `buffer` and send them as one
+// FRAME_DATA frame of request `id`. Returns false if the connection is gone, `bytesRead` is 0 if
+// nothing could be read (and nothing was sent).
+inline bool sendFileChunk(SOCKET socket, uint32_t id, std::istream& file, char* buffer, uint32_t length, uint32_t& bytesRead) {
+    file.read(buffer, length);
+    bytesRead = (uint32_t)file.gcount();
+    return bytesRead == 0 || sendFrame(socket, FRAME_DATA, id, bytesRead, buffer, bytesRead);
+}
+
+struct FileInfo {
+    std::string name;
+    int size; // MB
+};
+
+// One "name size" line per file, as in file_list.txt ("big.bin 60") or as sent ("big.bin 60MB")
+inline std::vector<FileInfo> parseFileList(std::istream& file) {
+    std::vector<FileInfo> fileList;
+    std::string line;
+
+    while (std::getline(file, line)) {
+        std::istringstream iss(line);
+        std::string name;
+        int32_t size;
+        if (iss >> name >> size) {
+            fileList.push_back({ name, size });
+        }
+    }
+
+    return fileList;
+}
+
+inline std::string formatFileList(const std::vector<FileInfo>& fileList) {
+    std::ostringstream oss;
+    for (const auto& file : fileList) {
+        oss << file.name << " " << file.size << "MB\n";
+    }
+    return oss.str();
+}
+
+// In the handshake the file list goes out as a uint32 length and then the text, a list of
+// thousands of files spans many reads and must not run into the frames that follow it
+inline bool sendFileList(SOCKET socket, const std::string& text) {
+    uint32_t length = htonl((uint32_t)text.size());
+    return sendAll(socket, (char*)&length, sizeof(length)) && sendAll(socket, text.data(), (int)text.size());
+}
+
+inline bool recvFileList(SOCKET socket, std::string& text) {
+    uint32_t length;
+    if (!recvAll(socket, (char*)&length, sizeof(length)) || (length = ntohl(length)) > MAX_FILE_LIST_LENGTH) {
+        return false;
+    }
+    text.assign(length, '\0');
+    return length == 0 || recvAll(socket, &text[0], length);
+}
+
+struct FileRequestFields {
+    std::string fileName;
+    std::string priority;
+    uint32_t offset = 0;       // Resume or piece offset
+    uint32_t expectedSize = 0; // File size the offset refers to
+    uint32_t length = 0;       // Piece length, 0 for the rest of the file
+};
+
+// "name|priority", optionally followed by "|offset|size" (resume) or "|offset|size|length" (piece)
+inline bool splitFileRequest(const std::string& data, FileRequestFields& fields) {
+    size_t delimiterPos = data.find("|");
+    if (delimiterPos == std::string::npos) {
+        return false;
+    }
+    fields.fileName = data.substr(0, delimiterPos);
+    fields.priority = data.substr(delimiterPos + 1);
+
+    size_t resumePos = fields.priority.find("|");
+    if (resumePos != std::string::npos) {
+        std::istringstream resume(fields.priority.substr(resumePos + 1));
+        char separator;
+        resume >> fields.offset >> separator >> fields.expectedSize >> separator >> fields.length;
+        fields.priority = fields.priority.substr(0, resumePos);
+    }
+    return true;
+}
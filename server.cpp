@@ -7,11 +7,14 @@
 #include <ws2tcpip.h>
 #include <thread>
 #include <cstdint>
+#include "socket_io.h"
+#include "socket_tuning.h"
 
 #pragma comment(lib, "Ws2_32.lib")
 
 #define PORT 8080
-#define BUFFER_SIZE 1024
+#define BUFFER_SIZE (64 * 1024) // Control messages, file data goes in chunks sized by socket_tuning.h
+#define MAX_REQUEST_LENGTH 1024 // Longest client name or requested file name accepted
 
 using namespace std;
 
@@ -37,12 +40,83 @@ vector<FileInfo> readFileList(const string& fileName) {
     return fileList;
 }
 
+// A batched request is: uint32 count, then for every file: uint32 name length + name
+bool recvFileRequests(SOCKET clientSocket, vector<string>& fileNames) {
+    uint32_t numFiles;
+    if (!recvAll(clientSocket, (char*)&numFiles, sizeof(numFiles))) {
+        return false;
+    }
+    numFiles = ntohl(numFiles);
+
+    for (uint32_t i = 0; i < numFiles; i++) {
+        uint32_t nameLength;
+        if (!recvAll(clientSocket, (char*)&nameLength, sizeof(nameLength))) {
+            return false;
+        }
+        nameLength = ntohl(nameLength);
+        if (nameLength == 0 || nameLength > MAX_REQUEST_LENGTH) {
+            cerr << "Invalid file name length in request: " << nameLength << endl;
+            return false;
+        }
+
+        string fileName(nameLength, '\0');
+        if (!recvAll(clientSocket, &fileName[0], nameLength)) {
+            return false;
+        }
+        fileNames.push_back(fileName);
+    }
+
+    return true;
+}
+
+// Send one response (size header followed by file data), returns false if the connection is gone
+bool sendFile(SOCKET clientSocket, const string& clientName, const string& fileName, TransferTuner& tuner) {
+    ifstream file(fileName, ios::binary);
+    if (!file.is_open()) {
+        // File not found, send file size as 0 in network byte order
+        int32_t fileSizeNetworkOrder = htonl(0);
+        return sendAll(clientSocket, (char*)&fileSizeNetworkOrder, sizeof(fileSizeNetworkOrder));
+    }
+
+    file.seekg(0, ios::end);
+    int32_t fileSize = static_cast<int32_t>(file.tellg());  // Use int32_t for file size
+    file.seekg(0, ios::beg);
+
+    // Send file size in network byte order, together with the first chunk of data
+    int32_t fileSizeNetworkOrder = htonl(fileSize);
+    bool headerSent = false;
+
+    // Send file data in chunks sized for this connection
+    vector<char> fileBuffer(MAX_CHUNK_SIZE);
+    while (!headerSent || !file.eof()) {
+        file.read(fileBuffer.data(), tuner.chunkSize);
+        uint32_t bytesRead = (uint32_t)file.gcount();
+
+        vector<SendBuffer> buffers;
+        if (!headerSent) {
+            buffers.push_back(makeSendBuffer(&fileSizeNetworkOrder, sizeof(fileSizeNetworkOrder)));
+        }
+        if (bytesRead > 0) {
+            buffers.push_back(makeSendBuffer(fileBuffer.data(), bytesRead));
+        }
+        if (!sendAllVectored(clientSocket, buffers)) {
+            return false;
+        }
+        headerSent = true;
+        updateTransferTuning(clientSocket, tuner, bytesRead, true);
+    }
+    file.close();
+
+    cout << "File " << fileName << " has been sent to " << clientName << endl;
+    return true;
+}
+
 void handleClient(SOCKET clientSocket, const vector<FileInfo>& fileList) {
     cout << "Client connected." << endl;
 
     // Receive client name
-    char clientName[BUFFER_SIZE] = { 0 };
-    int nameLength = recv(clientSocket, clientName, BUFFER_SIZE, 0);
+    char clientName[MAX_REQUEST_LENGTH] = { 0 };
+    int nameLength = recv(clientSocket, clientName, MAX_REQUEST_LENGTH, 0);
     string clientNameStr(clientName, nameLength);
     cout << "Client name: " << clientNameStr << endl;
 
@@ -54,41 +128,24 @@ void handleClient(SOCKET clientSocket, const vector<FileInfo>& fileList) {
     string fileListStr = oss.str();
     send(clientSocket, fileListStr.c_str(), fileListStr.size(), 0);
 
+    // The client may pipeline several batches, answer every file back-to-back in request order
+    TransferTuner tuner;
+    configureTransferSocket(clientSocket);
     while (true) {
-        // Receive requested file name from client
-        char buffer[BUFFER_SIZE] = { 0 };
-        int valread = recv(clientSocket, buffer, BUFFER_SIZE, 0);
-        if (valread <= 0) {
+        vector<string> fileNames;
+        if (!recvFileRequests(clientSocket, fileNames)) {
             break; // No more requests or error, close connection
         }
 
-        string fileName(buffer, valread);
-        ifstream file(fileName, ios::binary);
-        if (file.is_open()) {
-            file.seekg(0, ios::end);
-            int32_t fileSize = static_cast<int32_t>(file.tellg());  // Use int32_t for file size
-            file.seekg(0, ios::beg);
-
-            // Send file size in network byte order
-            int32_t fileSizeNetworkOrder = htonl(fileSize);
-            send(clientSocket, (char*)&fileSizeNetworkOrder, sizeof(fileSizeNetworkOrder), 0);
-
-            // Send file data
-            char fileBuffer[BUFFER_SIZE];
-            while (!file.eof()) {
-                file.read(fileBuffer, BUFFER_SIZE);
-                int bytesRead = file.gcount();
-                send(clientSocket, fileBuffer, bytesRead, 0);
+        bool connected = true;
+        for (const auto& fileName : fileNames) {
+            if (!sendFile(clientSocket, clientNameStr, fileName, tuner)) {
+                connected = false;
+                break;
             }
-            file.close();
-
-            cout << "File " << fileName << " has been sent to " << clientNameStr << endl;
         }
-        else {
-            // File not found, send file size as 0 in network byte order
-            int32_t fileSize = 0;
-            int32_t fileSizeNetworkOrder = htonl(fileSize);
-            send(clientSocket, (char*)&fileSizeNetworkOrder, sizeof(fileSizeNetworkOrder), 0);
+        if (!connected) {
+            break;
         }
     }
 
@@ -9,173 +9,1562 @@
 #include <cstdint>
 #include <map>
 #include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <memory>
+#include <set>
+#include <atomic>
+#include <random>
+#include <signal.h>
+#include <sys/stat.h>
+#include "download_state.h"
+#include "file_protocol.h"
+#include "socket_tuning.h"
+#include "trace_probe.h"
 
 #pragma comment(lib, "Ws2_32.lib")
 
 #define PORT 8080
-#define BUFFER_SIZE 1024
+#define BUFFER_SIZE (64 * 1024) // Control messages, file data goes in chunks sized by socket_tuning.h
+#define MAX_REQUEST_LENGTH 1024 // Longest client name or file request line accepted
+
+#define SMALL_FILE_SIZE (64 * 1024) // Files up to this size are bundled
+#define BUNDLE_MAX_BYTES (1024 * 1024) // Split bundles so big files still get their turn in between
+#define BUNDLE_PREBUILD_AFTER 3 // Keep a packed copy of a file set once it has been requested this many times
+#define BUNDLE_CACHE_BYTES (64 * 1024 * 1024) // Prebuilt bundles beyond this are evicted, least recently used first
+#define BUNDLE_COUNT_ENTRIES 4096 // File sets whose requests are counted, all counts are halved beyond this
+
+#define PIECE_SIZE (256 * 1024) // Swarm mode: files are verified and exchanged between clients in pieces of this size
+#define MAX_ANNOUNCE_LENGTH (MAX_REQUEST_LENGTH + (int)(0x100000000LL / PIECE_SIZE)) // "name|port|bitfield", one character per piece of a file up to 4GB
+#define MAX_PEERS_PER_REPLY 20 // A tracker reply lists at most this many other peers, picked at random
+
+#define HANDOFF_PORT 8081 // Loopback port a new server process (started with --takeover) connects to, the listening port + 1 with --port
+#define DRAIN_TIMEOUT_SECONDS 30 // How long Ctrl+C lets active downloads finish before closing them
+#define HANDOFF_TIMEOUT_SECONDS 10 // How long a hot restart waits for sessions to stop, senders stuck on a client that stopped reading are disconnected
+#define POLL_INTERVAL_MS 200 // How often blocked loops look at the shutdown state
+
+#define CACHE_DIR "cache" // Proxy mode: files fetched from the upstream server are kept here
+#define CACHE_INDEX_FILE "cache/cache.db" // Which cached files are complete, so a restart keeps them
+#define CACHE_MAX_BYTES (1024LL * 1024 * 1024) // Proxy mode disk budget, least recently used files are evicted beyond it
 
 using namespace std;
 
-struct FileInfo {
-    string name;
-    int size;
+// Proxy mode: a file fetched from the upstream server into CACHE_DIR. Sessions stream it while
+// it is still arriving. An entry is only evicted while no request holds a reference to it.
+struct CacheEntry {
+    string fileName;
+    string path;
+    uint32_t size = 0;
+    uint32_t available = 0; // Bytes written to the cache file so far
+    bool sizeKnown = false;
+    bool complete = false;
+    bool failed = false;    // Not found upstream, or the upstream connection was lost
+    uint64_t lastUsed = 0;
+    SOCKET upstreamSocket = INVALID_SOCKET; // Connection the fetch runs on
+};
+
+struct FileRequest {
+    uint32_t id;
+    string fileName;
+    int priority;
+    uint32_t remainingBytes;
+    uint32_t originalFileSize;
+    uint32_t endOffset; // The file size, or the end of the piece if a single piece was requested
+    bool sizeSent;
+    shared_ptr<CacheEntry> cacheEntry; // Proxy mode: the cached copy the file is streamed from
+    bool readFailed = false;           // FRAME_FAILED went out, the request is dropped
+};
+
+struct PieceList {
+    long long size;
+    time_t modifiedTime;
+    vector<uint32_t> checksums; // CRC-32 of every PIECE_SIZE piece, the last one may be shorter
+};
+
+struct BundledFile {
+    string fileName;
+    long long size;
+    time_t modifiedTime;
+    uint32_t checksum;
+    vector<char> data;
+    bool readable;
 };
 
+struct PrebuiltBundle {
+    shared_ptr<const vector<BundledFile>> files;
+    size_t bytes;
+    uint64_t lastUsed;
+};
+
+struct ClientSession {
+    SOCKET clientSocket;
+    string clientName;
+    vector<FileRequest> requestedFiles;
+    vector<vector<FileRequest>> pendingBundles;
+    vector<string> pendingReplies; // Tracker replies, already framed
+    vector<pair<uint32_t, string>> pendingAnnounces; // Announces still unanswered when the session stopped
+    set<pair<string, string>> announcedPeers; // (file name, peer address) entries this client put in the tracker
+    uint64_t bytesSent = 0;
+    bool greeted = false;  // The name handshake is done and the file list sent
+    bool connected = true;
+    atomic<bool> stopping{ false }; // Stop at the next frame boundary (drain deadline passed or handing off)
+    atomic<bool> waitingForCache{ false }; // Nothing can be sent until more arrives from the upstream server
+    TransferTuner tuner;   // Chunk size and send buffer for this connection, only the sender uses it
+    mutex fileMutex;
+    condition_variable filesAvailable;
+};
+
+// Sessions still running, parked sessions wait to be handed to the new process
+mutex sessionsMutex;
+condition_variable sessionsChanged;
+set<shared_ptr<ClientSession>> activeSessions;
+vector<shared_ptr<ClientSession>> parkedSessions;
+atomic<bool> draining(false);   // Ctrl+C: idle clients are disconnected, busy ones finish first
+atomic<bool> handingOff(false); // Hot restart: sessions stop between frames and keep their connection
+volatile sig_atomic_t stopRequested = 0;
+
+// Packed contents of a frequently requested set of small files
+map<string, PrebuiltBundle> prebuiltBundles;
+map<string, int> bundleRequestCounts;
+size_t prebuiltBundleBytes = 0;
+uint64_t bundleUseCounter = 0;
+mutex prebuiltBundleMutex;
+
+// Swarm mode tracker: which clients hold which pieces of a file, and where they accept peers
+map<string, map<string, string>> swarmPeers; // file name -> "ip:port" -> piece bitfield, '1' for a verified piece
+map<string, PieceList> pieceLists;
+mutex trackerMutex;
+
+// Proxy mode: this server is also a client of an upstream server and caches what it fetches
+string upstreamAddress; // "ip:port", empty unless proxying
+SOCKET upstreamSocket = INVALID_SOCKET;
+uint32_t nextUpstreamId = 1;
+mutex upstreamMutex; // Connecting and sending to the upstream server
+map<string, shared_ptr<CacheEntry>> cacheEntries;
+map<uint32_t, shared_ptr<CacheEntry>> upstreamFetches; // Upstream request id -> entry being fetched
+uint64_t cacheBytes = 0;
+uint64_t cacheMaxBytes = CACHE_MAX_BYTES;
+uint64_t cacheUseCounter = 0;
+DownloadStateStore cacheIndex(CACHE_DIR);
+mutex cacheMutex;
+condition_variable cacheChanged;
+atomic<uint64_t> cacheGeneration(0); // Bumped whenever cached files grow
+
+uint16_t listenPort = PORT;
+uint16_t handoffPort = HANDOFF_PORT;
+
 vector<FileInfo> readFileList(const string& fileName) {
-    vector<FileInfo> fileList;
     ifstream file(fileName);
-    string line;
+    return parseFileList(file);
+}
+
+// Proxy mode. Every file a client asks for is served from CACHE_DIR, a miss is fetched once from
+// the upstream server over a single connection that multiplexes all fetches like any client does.
+// Requests for a file that is still arriving share that fetch: each session streams the bytes
+// already written to the cache file and is woken up as more arrive.
+
+// Wake up every session whose sender waits for bytes from the upstream server. A sender in the
+// middle of a round holds its fileMutex while it writes to the client, so only waiting sessions
+// are locked, one slow client must not hold up the cache for everybody.
+void notifySessions() {
+    cacheGeneration++;
+    lock_guard<mutex> lock(sessionsMutex);
+    for (const auto& session : activeSessions) {
+        if (session->waitingForCache) {
+            lock_guard<mutex> sessionLock(session->fileMutex);
+            session->waitingForCache = false;
+            session->filesAvailable.notify_one();
+        }
+    }
+}
 
-    while (getline(file, line)) {
-        istringstream iss(line);
-        string name;
-        int32_t size;
-        if (iss >> name >> size) {
-            fileList.push_back({ name, size });
+// Evict least recently used files until `needed` more bytes fit, files a request still refers to
+// are kept even if that leaves the cache over budget. Caller must hold cacheMutex.
+void evictCache(uint64_t needed) {
+    TRACE_SCOPE("evictCache");
+    while (cacheBytes + needed > cacheMaxBytes) {
+        auto victim = cacheEntries.end();
+        for (auto it = cacheEntries.begin(); it != cacheEntries.end(); ++it) {
+            if (it->second->complete && it->second.use_count() == 1 &&
+                (victim == cacheEntries.end() || it->second->lastUsed < victim->second->lastUsed)) {
+                victim = it;
+            }
+        }
+        if (victim == cacheEntries.end()) {
+            cerr << "Cache is over budget, every cached file is in use" << endl;
+            return;
+        }
+
+        error_code error;
+        filesystem::remove(victim->second->path, error);
+        cacheIndex.erase(victim->first);
+        cacheBytes -= victim->second->size;
+        cout << "Evicted " << victim->first << " from the cache" << endl;
+        cacheEntries.erase(victim);
+    }
+}
+
+// Drop a fetch that will not complete, caller must hold cacheMutex
+void failCacheEntry(const shared_ptr<CacheEntry>& entry) {
+    entry->failed = true;
+    auto it = cacheEntries.find(entry->fileName);
+    if (it != cacheEntries.end() && it->second == entry) {
+        cacheEntries.erase(it);
+        if (entry->sizeKnown) {
+            cacheBytes -= entry->size;
         }
+        error_code error;
+        filesystem::remove(entry->path, error);
     }
+}
 
-    return fileList;
+// Client names become paths in CACHE_DIR, only plain file names are allowed: nothing that could
+// point outside of it, into a subdirectory, or at the index and its compaction temp file
+bool isCacheableName(const string& fileName) {
+    string indexName = filesystem::path(CACHE_INDEX_FILE).filename().string();
+    return !fileName.empty() && fileName.find("..") == string::npos && fileName.find_first_of("/\\:") == string::npos &&
+        fileName.compare(0, indexName.size(), indexName) != 0;
 }
 
-void sendFileChunks(SOCKET clientSocket, const string& clientName, const string& fileName, int chunksToSend, uint32_t& remainingBytes, uint32_t originalFileSize) {
-    if (remainingBytes > 0) {
-        ifstream fileStream(fileName, ios::binary);
-        if (fileStream) {
-            fileStream.seekg(originalFileSize - remainingBytes, ios::beg);
-            for (int i = 0; i < chunksToSend; ++i) {
-                char buffer[BUFFER_SIZE] = { 0 };
-                if (remainingBytes <= 0) break;
+// Find the cache entry of a file, creating it (as a miss) if the file is not cached yet.
+// NULL for a name that cannot be cached, it is answered as not found. Caller must hold cacheMutex.
+shared_ptr<CacheEntry> lookupCacheEntry(const string& fileName, bool& miss) {
+    miss = false;
+    if (!isCacheableName(fileName)) {
+        return NULL;
+    }
+    auto it = cacheEntries.find(fileName);
+    miss = it == cacheEntries.end();
+    if (miss) {
+        auto entry = make_shared<CacheEntry>();
+        entry->fileName = fileName;
+        entry->path = string(CACHE_DIR) + "/" + fileName;
+        it = cacheEntries.insert({ fileName, entry }).first;
+    }
+    it->second->lastUsed = ++cacheUseCounter;
+    return it->second;
+}
 
-                fileStream.read(buffer, min(BUFFER_SIZE, remainingBytes));
-                int bytesRead = fileStream.gcount();
-                if (bytesRead <= 0) break;
-                send(clientSocket, buffer, bytesRead, 0);
-                remainingBytes -= bytesRead;
+// Write what the upstream server sends into the cache, until the connection is lost
+void receiveFromUpstream(SOCKET sock) {
+    vector<char> buffer(MAX_CHUNK_SIZE);
+    map<uint32_t, ofstream> cacheFiles; // Upstream request id -> cache file being written
+    map<uint32_t, uint32_t> checksums;
+    map<uint32_t, uint32_t> discarded;  // Upstream request id -> bytes still to come of a fetch whose cache file failed
+    TransferTuner tuner;
+
+    while (true) {
+        uint32_t header[3];
+        if (!recvAll(sock, (char*)header, sizeof(header))) {
+            break;
+        }
+        uint32_t type = ntohl(header[0]);
+        uint32_t id = ntohl(header[1]);
+        uint32_t value = ntohl(header[2]);
+        if (type != FRAME_SIZE && type != FRAME_DATA && type != FRAME_FAILED) {
+            cerr << "Unexpected frame type " << type << " from upstream server\n";
+            break;
+        }
+
+        // Data is written before taking the lock, so senders are not held up by the disk
+        bool written = true;
+        if (type == FRAME_DATA) {
+            auto skipped = discarded.find(id);
+            auto file = cacheFiles.find(id);
+            if (value > MAX_CHUNK_SIZE || (file == cacheFiles.end() && skipped == discarded.end()) ||
+                !recvAll(sock, buffer.data(), value)) {
+                cerr << "Error receiving file data from upstream server\n";
+                break;
+            }
+            updateTransferTuning(sock, tuner, value, false);
+            if (skipped != discarded.end()) {
+                skipped->second -= min(skipped->second, value);
+                if (skipped->second == 0) {
+                    discarded.erase(skipped);
+                }
+                continue;
             }
+            written = file->second.write(buffer.data(), value) && file->second.flush();
+            checksums[id] = crc32(buffer.data(), value, checksums[id]);
+        }
+
+        {
+            lock_guard<mutex> lock(cacheMutex);
+            auto it = upstreamFetches.find(id);
+            if (it == upstreamFetches.end()) {
+                cerr << "Received data for unknown upstream request " << id << endl;
+                break;
+            }
+            shared_ptr<CacheEntry> entry = it->second;
 
-            if (remainingBytes <= 0) {
-                cout << "Completed sending " << fileName << " to " << clientName << endl;
+            if ((type == FRAME_SIZE && value == 0) || type == FRAME_FAILED) {
+                cacheFiles.erase(id); // Closed before failCacheEntry removes it
+                checksums.erase(id);
+                failCacheEntry(entry); // The client is told the file was not found, or that it failed
+                upstreamFetches.erase(it);
+            }
+            else if (type == FRAME_SIZE) {
+                evictCache(value);
+                entry->size = value;
+                entry->sizeKnown = true;
+                cacheBytes += value;
+                cacheFiles[id].open(entry->path, ios::binary | ios::trunc);
+                checksums[id] = 0;
+                if (!cacheFiles[id].is_open()) {
+                    cerr << "Unable to open file: " << entry->path << endl;
+                    cacheFiles.erase(id);
+                    checksums.erase(id);
+                    failCacheEntry(entry);
+                    upstreamFetches.erase(it);
+                    discarded[id] = value;
+                }
+            }
+            else if (!written) {
+                // Disk full or similar, the sessions streaming it drop their requests
+                cerr << "Unable to write to file: " << entry->path << endl;
+                cacheFiles.erase(id);
+                checksums.erase(id);
+                failCacheEntry(entry);
+                upstreamFetches.erase(it);
+                if (entry->size > entry->available + value) {
+                    discarded[id] = entry->size - entry->available - value;
+                }
+            }
+            else {
+                entry->available += value;
+                if (entry->available >= entry->size) {
+                    entry->complete = true;
+                    cacheIndex.markComplete(entry->fileName, entry->size, checksums[id]);
+                    cout << "Cached " << entry->fileName << endl;
+                    cacheFiles.erase(id);
+                    checksums.erase(id);
+                    upstreamFetches.erase(it);
+                }
             }
-            fileStream.close();
         }
-        else {
-            cerr << "Error opening file: " << fileName << endl;
+        cacheChanged.notify_all();
+        notifySessions();
+    }
+
+    cerr << "Connection to upstream server lost\n";
+    closesocket(sock);
+    {
+        lock_guard<mutex> lock(upstreamMutex);
+        if (upstreamSocket == sock) {
+            upstreamSocket = INVALID_SOCKET; // The next miss reconnects
         }
     }
+    {
+        lock_guard<mutex> lock(cacheMutex);
+        for (auto it = upstreamFetches.begin(); it != upstreamFetches.end();) {
+            if (it->second->upstreamSocket == sock) {
+                failCacheEntry(it->second);
+                it = upstreamFetches.erase(it);
+            }
+            else {
+                ++it;
+            }
+        }
+    }
+    cacheChanged.notify_all();
+    notifySessions();
 }
 
-void handleClient(SOCKET clientSocket, const vector<FileInfo>& fileList) {
-    cout << "Client connected." << endl;
+// Connect to the upstream server as a client named "proxy", caller must hold upstreamMutex
+bool connectUpstream(vector<FileInfo>* fileList) {
+    size_t colon = upstreamAddress.find(":");
+    sockaddr_in address;
+    address.sin_family = AF_INET;
+    address.sin_port = htons(colon == string::npos ? PORT : atoi(upstreamAddress.substr(colon + 1).c_str()));
+    if (inet_pton(AF_INET, upstreamAddress.substr(0, colon).c_str(), &address.sin_addr) <= 0) {
+        cerr << "Invalid upstream address: " << upstreamAddress << endl;
+        return false;
+    }
 
-    // Receive client name
-    char clientName[BUFFER_SIZE] = { 0 };
-    int nameLength = recv(clientSocket, clientName, BUFFER_SIZE, 0);
-    if (nameLength == SOCKET_ERROR) {
-        cerr << "Error receiving client name: " << WSAGetLastError() << endl;
-        closesocket(clientSocket);
+    SOCKET sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (sock == INVALID_SOCKET || connect(sock, (sockaddr*)&address, sizeof(address)) == SOCKET_ERROR) {
+        cerr << "Unable to reach upstream server " << upstreamAddress << endl;
+        closesocket(sock);
+        return false;
+    }
+
+    string fileListStr;
+    if (!sendAll(sock, "proxy", 5) || !recvFileList(sock, fileListStr)) {
+        cerr << "Handshake with upstream server " << upstreamAddress << " failed" << endl;
+        closesocket(sock);
+        return false;
+    }
+    if (fileList) {
+        istringstream list(fileListStr);
+        *fileList = parseFileList(list);
+    }
+
+    configureTransferSocket(sock);
+    upstreamSocket = sock;
+    thread receiver(receiveFromUpstream, sock);
+    receiver.detach();
+    return true;
+}
+
+// Request every miss of a batch from the upstream server with one batch of its own
+void fetchFromUpstream(const vector<pair<shared_ptr<CacheEntry>, string>>& misses) {
+    if (misses.empty()) {
         return;
     }
-    string clientNameStr(clientName, nameLength);
-    cout << "Client name: " << clientNameStr << endl;
 
-    // Send file list to client
-    ostringstream oss;
-    for (const auto& file : fileList) {
-        oss << file.name << " " << file.size << "MB\n";
+    lock_guard<mutex> upstreamLock(upstreamMutex);
+    bool connected = upstreamSocket != INVALID_SOCKET || connectUpstream(NULL);
+    string batch;
+    {
+        lock_guard<mutex> lock(cacheMutex);
+        for (const auto& miss : misses) {
+            if (!connected) {
+                failCacheEntry(miss.first);
+                continue;
+            }
+            cout << "Fetching " << miss.first->fileName << " from upstream server" << endl;
+            string dataToSend = miss.first->fileName + "|" + miss.second;
+            uint32_t entryHeader[2] = { htonl(nextUpstreamId), htonl(dataToSend.size()) };
+            batch.append((char*)entryHeader, sizeof(entryHeader));
+            batch.append(dataToSend);
+            miss.first->upstreamSocket = upstreamSocket;
+            upstreamFetches[nextUpstreamId++] = miss.first;
+        }
     }
-    string fileListStr = oss.str();
-    send(clientSocket, fileListStr.c_str(), fileListStr.size(), 0);
 
-    vector<pair<string, int>> requestedFiles;
-    map<string, uint32_t> remainingBytes;
-    map<string, uint32_t> originalFileSizes;
-    mutex fileMutex;
+    if (connected) {
+        uint32_t batchHeader[2] = { htonl(misses.size()), htonl(0) };
+        batch.insert(0, (char*)batchHeader, sizeof(batchHeader));
+        if (!sendAll(upstreamSocket, batch.c_str(), batch.size())) {
+            shutdown(upstreamSocket, SD_BOTH); // The receiver fails the fetches and cleans up
+        }
+    }
+    cacheChanged.notify_all();
+}
 
-    while (true) {
-        // Listen for a new file request list from the client
-        uint32_t numFiles;
-        int result = recv(clientSocket, (char*)&numFiles, sizeof(numFiles), 0);
-        if (result <= 0) {
-            cerr << "Error receiving number of files: " << WSAGetLastError() << endl;
-            closesocket(clientSocket);
-            return;
+// Start fetching every file of a request batch that is not cached, all in one upstream batch
+void prefetchFromUpstream(const vector<pair<uint32_t, string>>& entries) {
+    vector<pair<shared_ptr<CacheEntry>, string>> misses;
+    {
+        lock_guard<mutex> lock(cacheMutex);
+        for (const auto& entry : entries) {
+            size_t delimiterPos = entry.second.find("|");
+            size_t priorityEnd = entry.second.find("|", delimiterPos + 1);
+            if (delimiterPos == string::npos) {
+                continue;
+            }
+            bool miss;
+            auto cached = lookupCacheEntry(entry.second.substr(0, delimiterPos), miss);
+            if (miss) {
+                misses.push_back({ cached, entry.second.substr(delimiterPos + 1, priorityEnd - delimiterPos - 1) });
+            }
+        }
+    }
+    fetchFromUpstream(misses);
+}
+
+// The size of a file served through the cache in `fileSize`, 0 if the upstream server does not
+// have it. Waits until the upstream server sent the size if the file is still being fetched, but
+// gives up and returns false once `stopping` is set, a drain or handoff must not hang on it.
+bool cachedFileSize(const string& fileName, shared_ptr<CacheEntry>& entry, const atomic<bool>& stopping, uint32_t& fileSize) {
+    bool miss;
+    {
+        lock_guard<mutex> lock(cacheMutex);
+        entry = lookupCacheEntry(fileName, miss);
+    }
+    fileSize = 0;
+    if (!entry) {
+        return true;
+    }
+    if (miss) {
+        fetchFromUpstream({ { entry, "NORMAL" } });
+    }
+
+    unique_lock<mutex> lock(cacheMutex);
+    while (!cacheChanged.wait_for(lock, chrono::milliseconds(POLL_INTERVAL_MS), [&]() { return entry->sizeKnown || entry->failed; })) {
+        if (stopping) {
+            return false;
         }
-        numFiles = ntohl(numFiles);
+    }
+    if (entry->failed) {
+        entry = NULL;
+        return true;
+    }
+    fileSize = entry->size;
+    return true;
+}
+
+// Like cachedFileSize, but waits for the whole file. `path` is the cached copy, empty if the
+// upstream server does not have the file.
+bool waitForCachedFile(const string& fileName, shared_ptr<CacheEntry>& entry, const atomic<bool>& stopping, string& path) {
+    uint32_t fileSize;
+    path = "";
+    if (!cachedFileSize(fileName, entry, stopping, fileSize)) {
+        return false;
+    }
+    if (fileSize == 0) {
+        return true;
+    }
+    unique_lock<mutex> lock(cacheMutex);
+    while (!cacheChanged.wait_for(lock, chrono::milliseconds(POLL_INTERVAL_MS), [&]() { return entry->complete || entry->failed; })) {
+        if (stopping) {
+            return false;
+        }
+    }
+    if (entry->complete) {
+        path = entry->path;
+    }
+    return true;
+}
+
+// Whether a file can be sent whole right away, caller must not hold cacheMutex
+bool isFullyAvailable(const FileRequest& request) {
+    if (!request.cacheEntry) {
+        return true;
+    }
+    lock_guard<mutex> lock(cacheMutex);
+    return request.cacheEntry->complete;
+}
+
+// Pick up the files an earlier run cached, files that were still being fetched are dropped
+bool openCache() {
+    error_code error;
+    filesystem::create_directories(CACHE_DIR, error);
+    if (!cacheIndex.open(CACHE_INDEX_FILE, "")) {
+        return false;
+    }
+
+    string indexName = filesystem::path(CACHE_INDEX_FILE).filename().string();
+    for (const auto& item : filesystem::directory_iterator(CACHE_DIR, error)) {
+        string fileName = item.path().filename().string();
+        if (fileName.compare(0, indexName.size(), indexName) == 0) {
+            continue;
+        }
+
+        DownloadRecord record;
+        error_code sizeError;
+        uint64_t size = item.file_size(sizeError);
+        if (cacheIndex.find(fileName, record) && record.complete && record.size == size && !sizeError) {
+            auto entry = make_shared<CacheEntry>();
+            entry->fileName = fileName;
+            entry->path = string(CACHE_DIR) + "/" + fileName;
+            entry->size = entry->available = (uint32_t)size;
+            entry->sizeKnown = entry->complete = true;
+            cacheEntries[fileName] = entry;
+            cacheBytes += size;
+        }
+        else {
+            filesystem::remove(item.path(), sizeError);
+            cacheIndex.erase(fileName);
+        }
+    }
+
+    cout << "Cache holds " << cacheEntries.size() << " files (" << cacheBytes / (1024 * 1024) << "MB)" << endl;
+    return true;
+}
+
+// Send up to `priority` chunks of one file, fewer if the session is asked to stop.
+// Returns false if the connection is gone. Caller must hold session.fileMutex.
+bool sendFileChunks(ClientSession& session, FileRequest& request, vector<char>& buffer) {
+    TRACE_SCOPE("sendFileChunks");
+    SOCKET clientSocket = session.clientSocket;
+    const string& clientName = session.clientName;
+    uint32_t chunkSize = session.tuner.chunkSize;
+    if (!request.sizeSent) {
+        if (!sendFrame(clientSocket, FRAME_SIZE, request.id, request.originalFileSize, NULL, 0)) {
+            return false;
+        }
+        request.sizeSent = true;
+    }
+
+    // Proxy mode: only what already arrived from the upstream server can be sent
+    string path = request.fileName;
+    uint32_t readableEnd = request.endOffset;
+    bool fetchFailed = false;
+    if (request.cacheEntry) {
+        lock_guard<mutex> lock(cacheMutex);
+        fetchFailed = request.cacheEntry->failed;
+        path = request.cacheEntry->path;
+        readableEnd = min(readableEnd, request.cacheEntry->available);
+    }
+    if (fetchFailed) {
+        // The client asks again and gets a fresh fetch
+        cerr << "Upstream fetch of " << request.fileName << " failed, dropping the request of " << clientName << endl;
+        request.readFailed = true;
+        return sendFrame(clientSocket, FRAME_FAILED, request.id, 0, NULL, 0);
+    }
+
+    uint32_t position = request.endOffset - request.remainingBytes;
+    if (request.remainingBytes > 0 && position < readableEnd) {
+        ifstream fileStream(path, ios::binary);
+        fileStream.seekg(position, ios::beg);
+        for (int i = 0; i < request.priority; ++i) {
+            if (request.remainingBytes <= 0 || position >= readableEnd || session.stopping) break;
+
+            uint32_t bytesRead;
+            if (!sendFileChunk(clientSocket, request.id, fileStream, buffer.data(), min(chunkSize, readableEnd - position), bytesRead)) {
+                return false;
+            }
+            if (bytesRead == 0) {
+                // Deleted or shrunk since its size was sent, retrying every round would never finish it
+                cerr << "Error reading file: " << request.fileName << ", dropping the request" << endl;
+                request.readFailed = true;
+                return sendFrame(clientSocket, FRAME_FAILED, request.id, 0, NULL, 0);
+            }
+            request.remainingBytes -= bytesRead;
+            position += bytesRead;
+        }
+
+        if (request.remainingBytes <= 0) {
+            cout << "Completed sending " << request.fileName << " to " << clientName << endl;
+        }
+    }
+
+    return true;
+}
+
+// Load every file of a bundle, reusing the prebuilt copy if this set is requested often
+shared_ptr<const vector<BundledFile>> loadBundle(const vector<FileRequest>& requests) {
+    TRACE_SCOPE("loadBundle");
+    string key;
+    for (const auto& request : requests) {
+        key += request.fileName + "\n";
+    }
+
+    {
+        lock_guard<mutex> lock(prebuiltBundleMutex);
+        auto it = prebuiltBundles.find(key);
+        if (it != prebuiltBundles.end()) {
+            // A stat per file is still far cheaper than opening and reading it again
+            bool upToDate = true;
+            for (const auto& file : *it->second.files) {
+                struct stat info;
+                if (stat(file.fileName.c_str(), &info) != 0 || info.st_size != file.size || info.st_mtime != file.modifiedTime) {
+                    upToDate = false;
+                    break;
+                }
+            }
+            if (upToDate) {
+                it->second.lastUsed = ++bundleUseCounter;
+                return it->second.files;
+            }
+            prebuiltBundleBytes -= it->second.bytes;
+            prebuiltBundles.erase(it);
+        }
+    }
+
+    auto files = make_shared<vector<BundledFile>>();
+    size_t totalBytes = 0;
+    bool allReadable = true;
+    for (const auto& request : requests) {
+        // Bundles carry only files the cache holds completely, see runSession
+        BundledFile file = { request.cacheEntry ? request.cacheEntry->path : request.fileName, 0, 0, 0, {}, false };
+        struct stat info;
+        ifstream fileStream(file.fileName, ios::binary);
+        if (fileStream && stat(file.fileName.c_str(), &info) == 0) {
+            file.size = info.st_size;
+            file.modifiedTime = info.st_mtime;
+            file.data.resize(info.st_size);
+            fileStream.read(file.data.data(), file.data.size());
+            file.readable = fileStream.gcount() == info.st_size;
+            file.data.resize(fileStream.gcount());
+            file.checksum = crc32(file.data.data(), file.data.size());
+        }
+        allReadable = allReadable && file.readable;
+        totalBytes += file.data.size();
+        files->push_back(move(file));
+    }
+
+    lock_guard<mutex> lock(prebuiltBundleMutex);
+    // Age the counts once too many sets are tracked, sets nobody asks for any more drop out
+    if (bundleRequestCounts.size() >= BUNDLE_COUNT_ENTRIES && bundleRequestCounts.count(key) == 0) {
+        for (auto it = bundleRequestCounts.begin(); it != bundleRequestCounts.end();) {
+            it->second /= 2;
+            it = it->second == 0 ? bundleRequestCounts.erase(it) : next(it);
+        }
+    }
+    if (++bundleRequestCounts[key] < BUNDLE_PREBUILD_AFTER || !allReadable || totalBytes > BUNDLE_CACHE_BYTES) {
+        return files;
+    }
+
+    // Make room by evicting the least recently used bundles
+    while (prebuiltBundleBytes + totalBytes > BUNDLE_CACHE_BYTES) {
+        auto victim = prebuiltBundles.begin();
+        for (auto it = prebuiltBundles.begin(); it != prebuiltBundles.end(); ++it) {
+            if (it->second.lastUsed < victim->second.lastUsed) {
+                victim = it;
+            }
+        }
+        prebuiltBundleBytes -= victim->second.bytes;
+        prebuiltBundles.erase(victim);
+    }
+    prebuiltBundles[key] = { files, totalBytes, ++bundleUseCounter };
+    prebuiltBundleBytes += totalBytes;
+    return files;
+}
+
+// Send many small files as one frame: a compact index followed by the file data back-to-back.
+// Offsets are implied by the sizes, the client unpacks each file as the bytes stream in.
+bool sendBundle(SOCKET clientSocket, const string& clientName, const vector<FileRequest>& requests) {
+    TRACE_SCOPE("sendBundle");
+    shared_ptr<const vector<BundledFile>> files = loadBundle(requests);
+
+    // A file that could not be read is answered as not found, an empty entry would pass as an empty file
+    vector<size_t> bundled;
+    for (size_t i = 0; i < requests.size(); i++) {
+        if ((*files)[i].readable) {
+            bundled.push_back(i);
+        }
+        else if (!sendFrame(clientSocket, FRAME_SIZE, requests[i].id, 0, NULL, 0)) {
+            return false;
+        }
+        else {
+            cerr << "Error reading file: " << requests[i].fileName << ", sent as not found" << endl;
+        }
+    }
+    if (bundled.empty()) {
+        return true;
+    }
+
+    uint32_t header[3] = { htonl(FRAME_BUNDLE), htonl(0), htonl(bundled.size()) };
+    vector<uint32_t> index;
+    for (size_t i : bundled) {
+        index.push_back(htonl(requests[i].id));
+        index.push_back(htonl((*files)[i].data.size()));
+        index.push_back(htonl((*files)[i].checksum));
+    }
+
+    vector<SendBuffer> buffers;
+    buffers.push_back(makeSendBuffer(header, sizeof(header)));
+    buffers.push_back(makeSendBuffer(index.data(), index.size() * sizeof(uint32_t)));
+    for (size_t i : bundled) {
+        const BundledFile& file = (*files)[i];
+        if (!file.data.empty()) {
+            buffers.push_back(makeSendBuffer(file.data.data(), file.data.size()));
+        }
+    }
+    if (!sendAllVectored(clientSocket, buffers)) {
+        return false;
+    }
+
+    cout << "Completed sending bundle of " << bundled.size() << " files to " << clientName << endl;
+    return true;
+}
+
+// A batch is: uint32 count, uint32 flags, then for every entry: uint32 request id, uint32 length, data
+bool recvBatch(SOCKET clientSocket, uint32_t& flags, vector<pair<uint32_t, string>>& entries) {
+    uint32_t batchHeader[2];
+    if (!recvAll(clientSocket, (char*)batchHeader, sizeof(batchHeader))) {
+        return false;
+    }
+    uint32_t numEntries = ntohl(batchHeader[0]);
+    flags = ntohl(batchHeader[1]);
+
+    uint32_t maxLength = (flags & BATCH_ANNOUNCE) ? MAX_ANNOUNCE_LENGTH : MAX_REQUEST_LENGTH;
+    for (uint32_t i = 0; i < numEntries; i++) {
+        uint32_t entryHeader[2];
+        if (!recvAll(clientSocket, (char*)entryHeader, sizeof(entryHeader))) {
+            cerr << "Error receiving file name and priority\n";
+            return false;
+        }
+        uint32_t id = ntohl(entryHeader[0]);
+        uint32_t dataLen = ntohl(entryHeader[1]);
+        if (dataLen == 0 || dataLen > maxLength) {
+            cerr << "Invalid request length: " << dataLen << endl;
+            return false;
+        }
+
+        string dataReceived(dataLen, '\0');
+        if (!recvAll(clientSocket, &dataReceived[0], dataLen)) {
+            cerr << "Error receiving file name and priority\n";
+            return false;
+        }
+        entries.push_back({ id, dataReceived });
+    }
+
+    return true;
+}
+
+// A file request is "name|priority". An interrupted download appends "|offset|size", it resumes
+// only if the file still has that size. A swarm client fetching one piece appends "|offset|size|length".
+// Returns false for a malformed request, or in proxy mode if `stopping` was set while the size was awaited.
+bool parseFileRequest(uint32_t id, const string& dataReceived, FileRequest& request, const atomic<bool>& stopping) {
+    TRACE_SCOPE("parseFileRequest");
+    FileRequestFields fields;
+    if (!splitFileRequest(dataReceived, fields)) {
+        cerr << "Delimiter not found in received data\n";
+        return false;
+    }
+    const string& fileName = fields.fileName;
+    uint32_t resumeOffset = fields.offset;
+    uint32_t expectedSize = fields.expectedSize;
+    uint32_t length = fields.length;
+    int priorityValue = (fields.priority == "CRITICAL") ? 10 : (fields.priority == "HIGH") ? 4 : 1;
+
+    // A size of 0 tells the client the file was not found
+    uint32_t fileSize = 0;
+    shared_ptr<CacheEntry> cacheEntry;
+    if (!upstreamAddress.empty()) {
+        if (!cachedFileSize(fileName, cacheEntry, stopping, fileSize)) {
+            return false;
+        }
+    }
+    else {
+        ifstream fileStream(fileName, ios::binary);
+        if (fileStream) {
+            fileStream.seekg(0, ios::end);
+            streamoff end = fileStream.tellg(); // -1 for a directory
+            fileSize = end > 0 && end <= UINT32_MAX ? (uint32_t)end : 0;
+        }
+    }
+    uint32_t remainingBytes = fileSize;
+    uint32_t endOffset = fileSize;
+    if (length > 0) {
+        // A piece of a file that changed meanwhile is not sent at all, the size alone tells the peer
+        bool matches = fileSize == expectedSize && resumeOffset < fileSize;
+        remainingBytes = matches ? min(length, fileSize - resumeOffset) : 0;
+        endOffset = matches ? resumeOffset + remainingBytes : 0;
+    }
+    else if (resumeOffset > 0 && fileSize == expectedSize && resumeOffset <= fileSize) {
+        remainingBytes = fileSize - resumeOffset;
+    }
+    request = { id, fileName, priorityValue, remainingBytes, fileSize, endOffset, false, cacheEntry };
+    return true;
+}
+
+// Piece checksums of a file the server seeds, computed once and kept while the file is unchanged.
+// Caller must hold trackerMutex.
+bool loadPieceList(const string& fileName, PieceList& pieces) {
+    TRACE_SCOPE("loadPieceList");
+    struct stat info;
+    if (stat(fileName.c_str(), &info) != 0 || info.st_size == 0) {
+        return false;
+    }
+    auto it = pieceLists.find(fileName);
+    if (it != pieceLists.end() && it->second.size == info.st_size && it->second.modifiedTime == info.st_mtime) {
+        pieces = it->second;
+        return true;
+    }
+
+    ifstream fileStream(fileName, ios::binary);
+    if (!fileStream) {
+        return false;
+    }
+    pieces = { info.st_size, info.st_mtime, {} };
+    vector<char> buffer(PIECE_SIZE);
+    while (fileStream.read(buffer.data(), buffer.size()) || fileStream.gcount() > 0) {
+        pieces.checksums.push_back(crc32(buffer.data(), fileStream.gcount()));
+    }
+    pieceLists[fileName] = pieces;
+    return true;
+}
+
+// Swarm mode. A client announces "name|port|pieces" for every file it is downloading or seeding,
+// pieces being one '0' or '1' per piece. The reply is text, one field per line:
+//   file <name>
+//   size <bytes>                      (0 if the server does not have the file)
+//   pieces <crc32> <crc32> ...        (hex, to verify every piece whoever sent it)
+//   origin <index> <count>            (fetch from the server only the pieces i with i % count == index)
+//   peer <ip:port> <pieces>           (once per other peer)
+// Splitting the origin pieces between the peers means every piece normally leaves the server once,
+// the peers trade the rest among themselves. Empty for an invalid announce, or in proxy mode if the
+// session was asked to stop while the file was still arriving.
+string trackerReply(ClientSession& session, const string& announce) {
+    TRACE_SCOPE("trackerReply");
+    size_t delimiterPos = announce.find("|");
+    size_t portPos = announce.find("|", delimiterPos + 1);
+    if (delimiterPos == string::npos || portPos == string::npos) {
+        cerr << "Invalid announce: " << announce << endl;
+        return "";
+    }
+    string fileName = announce.substr(0, delimiterPos);
+    string port = announce.substr(delimiterPos + 1, portPos - delimiterPos - 1);
+    string bitfield = announce.substr(portPos + 1);
+
+    // Peers connect to the address this client connected from
+    sockaddr_in address;
+    socklen_t addressLength = sizeof(address);
+    char host[INET_ADDRSTRLEN] = "127.0.0.1";
+    if (getpeername(session.clientSocket, (sockaddr*)&address, &addressLength) == 0) {
+        inet_ntop(AF_INET, &address.sin_addr, host, sizeof(host));
+    }
+    string self = string(host) + ":" + port;
+
+    // Proxy mode: pieces are checked against the cached copy, which has to be complete for that
+    string path = fileName;
+    shared_ptr<CacheEntry> cacheEntry;
+    if (!upstreamAddress.empty() && !waitForCachedFile(fileName, cacheEntry, session.stopping, path)) {
+        return "";
+    }
+
+    ostringstream reply;
+    reply << "file " << fileName << "\n";
+    lock_guard<mutex> lock(trackerMutex);
+    PieceList pieces;
+    if (path.empty() || !loadPieceList(path, pieces)) {
+        reply << "size 0\n";
+        return reply.str();
+    }
+    reply << "size " << pieces.size << "\npieces" << hex;
+    for (uint32_t checksum : pieces.checksums) {
+        reply << " " << checksum;
+    }
+    reply << dec << "\n";
+
+    auto& peers = swarmPeers[fileName];
+    peers[self] = bitfield;
+    session.announcedPeers.insert({ fileName, self });
+    reply << "origin " << distance(peers.begin(), peers.find(self)) << " " << peers.size() << "\n";
 
+    vector<pair<string, string>> others;
+    for (const auto& peer : peers) {
+        if (peer.first != self) {
+            others.push_back(peer);
+        }
+    }
+    shuffle(others.begin(), others.end(), mt19937(random_device()()));
+    others.resize(min(others.size(), (size_t)MAX_PEERS_PER_REPLY));
+    for (const auto& peer : others) {
+        reply << "peer " << peer.first << " " << peer.second << "\n";
+    }
+    return reply.str();
+}
+
+// Answer a batch of announces. What is left when the session is asked to stop stays in
+// pendingAnnounces, the next serveSession (here or in the process taking over) answers it.
+void answerAnnounces(ClientSession& session, const vector<pair<uint32_t, string>>& entries) {
+    vector<string> replies;
+    size_t answered = 0;
+    for (; answered < entries.size() && !session.stopping; answered++) {
+        string reply = trackerReply(session, entries[answered].second);
+        if (session.stopping) {
+            break; // The reply may have been cut short while waiting for the upstream server
+        }
+        uint32_t header[3] = { htonl(FRAME_PEERS), htonl(entries[answered].first), htonl(reply.size()) };
+        replies.push_back(string((char*)header, sizeof(header)) + reply);
+    }
+
+    lock_guard<mutex> lock(session.fileMutex);
+    session.pendingReplies.insert(session.pendingReplies.end(), replies.begin(), replies.end());
+    session.pendingAnnounces.insert(session.pendingAnnounces.end(), entries.begin() + answered, entries.end());
+    session.waitingForCache = false;
+    session.filesAvailable.notify_one();
+}
+
+// Forget every piece a client announced, it can no longer serve them
+void removeAnnounces(ClientSession& session) {
+    lock_guard<mutex> lock(trackerMutex);
+    for (const auto& announced : session.announcedPeers) {
+        auto it = swarmPeers.find(announced.first);
+        if (it != swarmPeers.end()) {
+            it->second.erase(announced.second);
+            if (it->second.empty()) {
+                swarmPeers.erase(it);
+            }
+        }
+    }
+    session.announcedPeers.clear();
+}
+
+// Caller must hold session.fileMutex
+bool sessionHasWork(const ClientSession& session) {
+    return !session.requestedFiles.empty() || !session.pendingBundles.empty() || !session.pendingReplies.empty();
+}
+
+// Caller must hold session.fileMutex
+bool sessionShouldStop(const ClientSession& session) {
+    return session.stopping || !session.connected || (draining && !sessionHasWork(session));
+}
+
+// Receive the client name and send the file list. Waits for the name the way the batch loop waits
+// for batches, so a drain or handoff is noticed while a client is still connecting. Returns false
+// if the session ends here, a session stopped for a handoff is still connected and gets parked.
+bool greetClient(ClientSession& session, const vector<FileInfo>& fileList) {
+    while (true) {
+        fd_set readable;
+        FD_ZERO(&readable);
+        FD_SET(session.clientSocket, &readable);
+        timeval timeout = { 0, POLL_INTERVAL_MS * 1000 };
+        int ready = select(session.clientSocket + 1, &readable, NULL, NULL, &timeout);
         {
-            lock_guard<mutex> lock(fileMutex);
-            for (uint32_t i = 0; i < numFiles; i++) {
-                char dataBuffer[BUFFER_SIZE] = { 0 };
-
-                int dataLen = recv(clientSocket, dataBuffer, BUFFER_SIZE, 0);
-                if (dataLen <= 0) {
-                    cerr << "Error receiving file name and priority\n";
-                    closesocket(clientSocket);
-                    return;
+            lock_guard<mutex> lock(session.fileMutex);
+            if (sessionShouldStop(session)) {
+                return false;
+            }
+        }
+        if (ready == SOCKET_ERROR) {
+            session.connected = false;
+            return false;
+        }
+        if (ready > 0) {
+            break;
+        }
+    }
+
+    char clientName[MAX_REQUEST_LENGTH] = { 0 };
+    int nameLength = recv(session.clientSocket, clientName, MAX_REQUEST_LENGTH, 0);
+    if (nameLength <= 0) {
+        cerr << "Error receiving client name: " << WSAGetLastError() << endl;
+        session.connected = false;
+        return false;
+    }
+    session.clientName = string(clientName, nameLength);
+    cout << "Client name: " << session.clientName << endl;
+
+    // Send file list to client
+    string fileListStr;
+    {
+        TRACE_SCOPE("formatFileList");
+        fileListStr = formatFileList(fileList);
+    }
+    if (!sendFileList(session.clientSocket, fileListStr)) {
+        cerr << "Error sending file list to " << session.clientName << endl;
+        session.connected = false;
+        return false;
+    }
+
+    configureTransferSocket(session.clientSocket);
+    session.greeted = true;
+    return true;
+}
+
+// Stream what the client requests until it disconnects, the server drains, or the session is handed off
+void serveSession(shared_ptr<ClientSession> session) {
+    // One sender per client streams the chunks of every requested file, weighted by priority,
+    // while this thread keeps accepting new batches. Only the sender writes to the socket.
+    thread sender([session]() {
+        vector<char> chunkBuffer(MAX_CHUNK_SIZE);
+        unique_lock<mutex> lock(session->fileMutex);
+        while (true) {
+            // Timed, stopSessions and drainSessions notify without fileMutex since it is held here while sending
+            if (!session->filesAvailable.wait_for(lock, chrono::milliseconds(POLL_INTERVAL_MS), [&]() {
+                return (sessionHasWork(*session) && !session->waitingForCache) || sessionShouldStop(*session);
+                })) {
+                continue;
+            }
+            if (sessionShouldStop(*session)) {
+                break;
+            }
+            uint64_t generation = cacheGeneration;
+
+            // Tracker replies and bundles are small by construction, send them whole before the next round
+            uint64_t bytesSent = 0;
+            while (!session->pendingReplies.empty() && !session->stopping) {
+                const string& reply = session->pendingReplies.front();
+                if (!sendAll(session->clientSocket, reply.c_str(), reply.size())) {
+                    session->connected = false;
+                    shutdown(session->clientSocket, SD_BOTH);
+                    break;
+                }
+                session->pendingReplies.erase(session->pendingReplies.begin());
+            }
+            while (!session->pendingBundles.empty() && !session->stopping) {
+                if (!sendBundle(session->clientSocket, session->clientName, session->pendingBundles.front())) {
+                    session->connected = false;
+                    shutdown(session->clientSocket, SD_BOTH); // Wake up the receiving thread as well
+                    break;
                 }
+                for (const auto& request : session->pendingBundles.front()) {
+                    bytesSent += request.originalFileSize;
+                }
+                session->pendingBundles.erase(session->pendingBundles.begin());
+            }
+            if (sessionShouldStop(*session)) {
+                break;
+            }
 
-                string dataReceived(dataBuffer, dataLen);
-                // Split the string based on the delimiter "|"
-                size_t delimiterPos = dataReceived.find("|");
-                if (delimiterPos != string::npos) {
-                    string fileName = dataReceived.substr(0, delimiterPos);
-                    string priority = dataReceived.substr(delimiterPos + 1);
-
-                    int priorityValue = (priority == "CRITICAL") ? 10 : (priority == "HIGH") ? 4 : 1;
-                    requestedFiles.push_back({ fileName, priorityValue });
-
-                    // If the file is new, calculate and send the file size
-                    if (remainingBytes.find(fileName) == remainingBytes.end()) {
-                        ifstream fileStream(fileName, ios::binary);
-                        if (fileStream) {
-                            fileStream.seekg(0, ios::end);
-                            uint32_t fileSize = fileStream.tellg();
-                            originalFileSizes[fileName] = fileSize;
-                            remainingBytes[fileName] = fileSize;
-                            uint32_t fileSizeNetworkOrder = htonl(fileSize);
-                            send(clientSocket, (char*)&fileSizeNetworkOrder, sizeof(fileSizeNetworkOrder), 0);
-                        }
-                        else {
-                            uint32_t fileSize = 0;
-                            uint32_t fileSizeNetworkOrder = htonl(fileSize);
-                            send(clientSocket, (char*)&fileSizeNetworkOrder, sizeof(fileSizeNetworkOrder), 0);
-                        }
-                    }
+            bool progressed = bytesSent > 0;
+            for (auto& file : session->requestedFiles) {
+                if (session->stopping) {
+                    break;
                 }
-                else {
-                    cerr << "Delimiter not found in received data\n";
+                uint32_t remainingBefore = file.remainingBytes;
+                bool sizeSentBefore = file.sizeSent;
+                bool failedBefore = file.readFailed;
+                if (!sendFileChunks(*session, file, chunkBuffer)) {
+                    session->connected = false;
+                    shutdown(session->clientSocket, SD_BOTH);
+                    break;
                 }
+                bytesSent += remainingBefore - file.remainingBytes;
+                progressed = progressed || remainingBefore != file.remainingBytes || sizeSentBefore != file.sizeSent ||
+                    failedBefore != file.readFailed;
             }
+            // Proxy mode: every file waits for the upstream server, sleep until the cache grows. The flag
+            // is set before the generation is read again, so either notifySessions sees the flag or
+            // we see that the cache grew meanwhile.
+            if (!progressed) {
+                session->waitingForCache = true;
+                if (cacheGeneration != generation) {
+                    session->waitingForCache = false;
+                }
+            }
+            updateTransferTuning(session->clientSocket, session->tuner, bytesSent, true);
+            session->bytesSent += bytesSent;
+
+            session->requestedFiles.erase(
+                remove_if(session->requestedFiles.begin(), session->requestedFiles.end(),
+                    [](const FileRequest& file) { return file.readFailed || (file.sizeSent && file.remainingBytes <= 0); }),
+                session->requestedFiles.end()
+            );
+
+            // Let the receiving thread queue new requests between rounds
+            lock.unlock();
+            this_thread::yield();
+            lock.lock();
         }
+        });
 
-        // Handle the file transfer logic with the updated list
-        thread([&]() {
-            while (!requestedFiles.empty()) {
-                lock_guard<mutex> lock(fileMutex);
-                for (auto& file : requestedFiles) {
-                    sendFileChunks(clientSocket, clientNameStr, file.first, file.second, remainingBytes[file.first], originalFileSizes[file.first]);
-                }
+    // Announces a handoff interrupted, the client waits for their replies before it downloads
+    vector<pair<uint32_t, string>> announces;
+    {
+        lock_guard<mutex> lock(session->fileMutex);
+        announces.swap(session->pendingAnnounces);
+    }
+    if (!announces.empty()) {
+        answerAnnounces(*session, announces);
+    }
+
+    bool stopped = false;
+    while (true) {
+        // Wait for the next batch with a timeout, so a drain or handoff is noticed between batches
+        fd_set readable;
+        FD_ZERO(&readable);
+        FD_SET(session->clientSocket, &readable);
+        timeval timeout = { 0, POLL_INTERVAL_MS * 1000 };
+        int ready = select(session->clientSocket + 1, &readable, NULL, NULL, &timeout);
+        {
+            lock_guard<mutex> lock(session->fileMutex);
+            stopped = sessionShouldStop(*session);
+        }
+        if (stopped || ready == SOCKET_ERROR) {
+            break;
+        }
+        if (ready == 0) {
+            continue;
+        }
+
+        // Listen for the next batch of file requests from the client
+        vector<pair<uint32_t, string>> entries;
+        uint32_t flags;
+        if (!recvBatch(session->clientSocket, flags, entries)) {
+            break;
+        }
+        if (draining) {
+            // Only what is already queued gets to finish, the client asks again after reconnecting
+            cout << "Draining, ignoring " << entries.size() << " new requests from " << session->clientName << endl;
+            continue;
+        }
+
+        if (flags & BATCH_ANNOUNCE) {
+            answerAnnounces(*session, entries);
+            continue;
+        }
+
+        // Proxy mode: all misses of the batch go upstream at once before any size is waited for
+        if (!upstreamAddress.empty()) {
+            prefetchFromUpstream(entries);
+        }
+        vector<FileRequest> newRequests;
+        bool interrupted = false;
+        for (const auto& entry : entries) {
+            FileRequest request;
+            if (parseFileRequest(entry.first, entry.second, request, session->stopping)) {
+                newRequests.push_back(request);
+            }
+            else if (!upstreamAddress.empty() && session->stopping) {
+                interrupted = true;
+                break;
+            }
+        }
+        if (interrupted) {
+            // These requests have no size yet and cannot be handed over, the connection is closed
+            cerr << "Stopped while waiting for the upstream server, closing " << session->clientName << endl;
+            break;
+        }
+
+        // Small files go into bundles (if the client supports them), the rest is streamed in chunks
+        vector<FileRequest> chunkedFiles;
+        vector<vector<FileRequest>> bundles(1);
+        size_t bundleBytes = 0;
+        for (const auto& request : newRequests) {
+            // Resumed downloads, pieces and files still arriving from upstream are always chunked,
+            // a bundle carries whole files only
+            bool resumed = request.remainingBytes != request.originalFileSize || request.endOffset != request.originalFileSize;
+            if (!(flags & BATCH_ALLOW_BUNDLE) || resumed || request.originalFileSize == 0 || request.originalFileSize > SMALL_FILE_SIZE ||
+                !isFullyAvailable(request)) {
+                chunkedFiles.push_back(request);
+                continue;
+            }
+            if (bundleBytes + request.originalFileSize > BUNDLE_MAX_BYTES) {
+                bundles.emplace_back();
+                bundleBytes = 0;
+            }
+            bundles.back().push_back(request);
+            bundleBytes += request.originalFileSize;
+        }
+
+        lock_guard<mutex> lock(session->fileMutex);
+        for (const auto& bundle : bundles) {
+            if (bundle.size() > 1) {
+                session->pendingBundles.push_back(bundle);
+            }
+            else {
+                chunkedFiles.insert(chunkedFiles.end(), bundle.begin(), bundle.end());
+            }
+        }
+        session->requestedFiles.insert(session->requestedFiles.end(), chunkedFiles.begin(), chunkedFiles.end());
+        session->waitingForCache = false;
+        session->filesAvailable.notify_one();
+    }
+
+    {
+        lock_guard<mutex> lock(session->fileMutex);
+        if (!stopped) {
+            session->connected = false;
+        }
+    }
+    session->filesAvailable.notify_one();
+    sender.join();
+}
+
+// Serve one client from the handshake on (or from where the old process left it after a takeover)
+void runSession(shared_ptr<ClientSession> session, const vector<FileInfo>& fileList) {
+    // Registered before the handshake, so a drain or handoff also covers clients still connecting
+    {
+        lock_guard<mutex> lock(sessionsMutex);
+        activeSessions.insert(session);
+    }
+
+    if (session->greeted || greetClient(*session, fileList)) {
+        serveSession(session);
+    }
+
+    // A session stopped for a handoff keeps its connection, the new process continues it
+    bool parked = handingOff && session->connected;
+    if (!parked) {
+        closesocket(session->clientSocket);
+        removeAnnounces(*session);
+        cout << session->clientName << " disconnected (" << session->bytesSent << " bytes sent).\n";
+    }
+
+    {
+        lock_guard<mutex> lock(sessionsMutex);
+        activeSessions.erase(session);
+        if (parked) {
+            parkedSessions.push_back(session);
+        }
+    }
+    sessionsChanged.notify_all();
+}
+
+void handleClient(SOCKET clientSocket, const vector<FileInfo>& fileList) {
+    cout << "Client connected." << endl;
+    auto session = make_shared<ClientSession>();
+    session->clientSocket = clientSocket;
+    runSession(session, fileList);
+}
+
+// Ask every session to stop, caller must hold sessionsMutex. fileMutex is not taken, a sender
+// blocked on a client that stopped reading holds it.
+void stopSessions() {
+    for (const auto& session : activeSessions) {
+        session->stopping = true; // A sender in the middle of a round sees it before its next frame
+        session->filesAvailable.notify_all();
+    }
+}
+
+// Ctrl+C: new connections are no longer accepted, idle clients are disconnected and
+// active downloads get DRAIN_TIMEOUT_SECONDS to finish. Whatever is still running after
+// that is closed, the clients resume from their last checkpoint when they come back.
+void drainSessions() {
+    unique_lock<mutex> lock(sessionsMutex);
+    cout << "Draining " << activeSessions.size() << " active clients..." << endl;
+
+    draining = true;
+    for (const auto& session : activeSessions) {
+        session->filesAvailable.notify_all();
+    }
+
+    if (!sessionsChanged.wait_for(lock, chrono::seconds(DRAIN_TIMEOUT_SECONDS), []() { return activeSessions.empty(); })) {
+        cout << "Drain timeout, closing " << activeSessions.size() << " remaining clients" << endl;
+        stopSessions();
+        sessionsChanged.wait_for(lock, chrono::seconds(5), []() { return activeSessions.empty(); });
+    }
+}
+
+void appendUint32(string& message, uint32_t value) {
+    value = htonl(value);
+    message.append((char*)&value, sizeof(value));
+}
+
+void appendString(string& message, const string& value) {
+    appendUint32(message, value.size());
+    message.append(value);
+}
+
+bool recvUint32(SOCKET socket, uint32_t& value) {
+    if (!recvAll(socket, (char*)&value, sizeof(value))) {
+        return false;
+    }
+    value = ntohl(value);
+    return true;
+}
+
+bool recvString(SOCKET socket, string& value) {
+    uint32_t length;
+    if (!recvUint32(socket, length)) {
+        return false;
+    }
+    value.resize(length);
+    return length == 0 || recvAll(socket, &value[0], length);
+}
 
-                requestedFiles.erase(
-                    remove_if(requestedFiles.begin(), requestedFiles.end(),
-                        [&](const pair<string, int>& file) { return remainingBytes[file.first] <= 0; }),
-                    requestedFiles.end()
-                );
-                this_thread::sleep_for(chrono::milliseconds(100)); // A slight delay to prevent tight loop
+bool appendSocket(string& message, SOCKET socket, DWORD processId) {
+    WSAPROTOCOL_INFO info;
+    if (WSADuplicateSocket(socket, processId, &info) == SOCKET_ERROR) {
+        cerr << "WSADuplicateSocket failed: " << WSAGetLastError() << endl;
+        return false;
+    }
+    message.append((char*)&info, sizeof(info));
+    return true;
+}
+
+SOCKET recvSocket(SOCKET controlSocket) {
+    WSAPROTOCOL_INFO info;
+    if (!recvAll(controlSocket, (char*)&info, sizeof(info))) {
+        return INVALID_SOCKET;
+    }
+    return WSASocket(FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO, &info, 0, 0);
+}
+
+// Hot restart, old process side. The new process sends its process id, every session is
+// stopped between two frames and parked, then the listening socket and every client
+// connection are duplicated into the new process together with what is left to send:
+//   listening socket, uint32 session count, then per session:
+//   socket, client name, uint32 greeted, uint32 request count, then per request:
+//   uint32 id, file name, uint32 priority, uint32 remaining bytes, uint32 file size, uint32 end offset, uint32 size sent
+//   then uint32 reply count, the framed tracker replies not yet sent,
+//   and uint32 announce count, then per announce: uint32 id, announce
+// Not yet sent bundles are handed over as plain requests. The tracker itself is not handed over,
+// it fills up again with the next announces, but unanswered announces are: a client only starts
+// downloading a file once the reply to its first announce arrived. A client still connecting is handed over before
+// its handshake, the new process waits for its name. The new process answers with one
+// byte once it owns all sockets, only then are the old descriptors closed. Without that byte
+// the sessions stay parked and resumeSessions continues them in this process.
+bool handOffTo(SOCKET controlSocket, SOCKET serverSocket) {
+    uint32_t processId;
+    if (!recvUint32(controlSocket, processId)) {
+        cerr << "Error receiving process id for handoff" << endl;
+        return false;
+    }
+
+    cout << "Handing off to process " << processId << "..." << endl;
+    {
+        unique_lock<mutex> lock(sessionsMutex);
+        handingOff = true;
+        stopSessions();
+        if (!sessionsChanged.wait_for(lock, chrono::seconds(HANDOFF_TIMEOUT_SECONDS), []() { return activeSessions.empty(); })) {
+            // A sender blocked on a client that stopped reading never reaches its next frame
+            cout << "Handoff timeout, disconnecting " << activeSessions.size() << " stuck clients" << endl;
+            for (const auto& session : activeSessions) {
+                shutdown(session->clientSocket, SD_BOTH);
             }
-            }).detach();
+            sessionsChanged.wait_for(lock, chrono::seconds(5), []() { return activeSessions.empty(); });
+        }
+    }
+
+    string message;
+    bool duplicated = appendSocket(message, serverSocket, processId);
+    appendUint32(message, parkedSessions.size());
+    for (const auto& session : parkedSessions) {
+        duplicated = duplicated && appendSocket(message, session->clientSocket, processId);
+        appendString(message, session->clientName);
+        appendUint32(message, session->greeted ? 1 : 0);
+
+        vector<FileRequest> requests = session->requestedFiles;
+        for (const auto& bundle : session->pendingBundles) {
+            requests.insert(requests.end(), bundle.begin(), bundle.end());
+        }
+        appendUint32(message, requests.size());
+        for (const auto& request : requests) {
+            appendUint32(message, request.id);
+            appendString(message, request.fileName);
+            appendUint32(message, request.priority);
+            appendUint32(message, request.remainingBytes);
+            appendUint32(message, request.originalFileSize);
+            appendUint32(message, request.endOffset);
+            appendUint32(message, request.sizeSent ? 1 : 0);
+        }
+
+        appendUint32(message, session->pendingReplies.size());
+        for (const auto& reply : session->pendingReplies) {
+            appendString(message, reply);
+        }
+        appendUint32(message, session->pendingAnnounces.size());
+        for (const auto& announce : session->pendingAnnounces) {
+            appendUint32(message, announce.first);
+            appendString(message, announce.second);
+        }
+    }
+
+    char ack = 0;
+    bool handedOff = duplicated && sendAll(controlSocket, message.c_str(), message.size()) &&
+        recvAll(controlSocket, &ack, sizeof(ack));
+    if (!handedOff) {
+        cerr << "Handoff to process " << processId << " failed, keeping " << parkedSessions.size() << " clients" << endl;
+        return false;
+    }
+    // Let the new process close the connection first, the side closing first keeps the handoff
+    // port in TIME_WAIT and the new process is about to listen on it
+    recv(controlSocket, &ack, sizeof(ack), 0);
+    for (const auto& session : parkedSessions) {
+        closesocket(session->clientSocket);
     }
+    parkedSessions.clear();
+    return true;
+}
+
+// A failed handoff: this process keeps serving, parked sessions continue where they stopped
+void resumeSessions(const vector<FileInfo>& fileList) {
+    vector<shared_ptr<ClientSession>> sessions;
+    {
+        lock_guard<mutex> lock(sessionsMutex);
+        handingOff = false;
+        sessions.swap(parkedSessions);
+    }
+    for (const auto& session : sessions) {
+        session->stopping = false;
+        thread sessionThread(runSession, session, fileList);
+        sessionThread.detach();
+    }
+}
+
+// Hot restart, new process side: take over the listening socket and every client session
+bool takeOver(SOCKET& serverSocket, vector<shared_ptr<ClientSession>>& sessions) {
+    SOCKET controlSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    sockaddr_in address;
+    address.sin_family = AF_INET;
+    address.sin_port = htons(handoffPort);
+    inet_pton(AF_INET, "127.0.0.1", &address.sin_addr);
+    if (controlSocket == INVALID_SOCKET || connect(controlSocket, (sockaddr*)&address, sizeof(address)) == SOCKET_ERROR) {
+        cerr << "Unable to reach the running server on port " << handoffPort << endl;
+        closesocket(controlSocket);
+        return false;
+    }
+
+    uint32_t processId = htonl(GetCurrentProcessId());
+    uint32_t numSessions = 0;
+    bool received = sendAll(controlSocket, (char*)&processId, sizeof(processId)) &&
+        (serverSocket = recvSocket(controlSocket)) != INVALID_SOCKET &&
+        recvUint32(controlSocket, numSessions);
+
+    for (uint32_t i = 0; received && i < numSessions; i++) {
+        auto session = make_shared<ClientSession>();
+        uint32_t greeted = 0, numRequests = 0;
+        session->clientSocket = recvSocket(controlSocket);
+        received = session->clientSocket != INVALID_SOCKET &&
+            recvString(controlSocket, session->clientName) &&
+            recvUint32(controlSocket, greeted) &&
+            recvUint32(controlSocket, numRequests);
+        session->greeted = greeted != 0;
+
+        for (uint32_t j = 0; received && j < numRequests; j++) {
+            FileRequest request;
+            uint32_t priority, sizeSent;
+            received = recvUint32(controlSocket, request.id) &&
+                recvString(controlSocket, request.fileName) &&
+                recvUint32(controlSocket, priority) &&
+                recvUint32(controlSocket, request.remainingBytes) &&
+                recvUint32(controlSocket, request.originalFileSize) &&
+                recvUint32(controlSocket, request.endOffset) &&
+                recvUint32(controlSocket, sizeSent);
+            request.priority = priority;
+            request.sizeSent = sizeSent != 0;
+            session->requestedFiles.push_back(request);
+        }
+
+        uint32_t numReplies = 0, numAnnounces = 0;
+        received = received && recvUint32(controlSocket, numReplies);
+        for (uint32_t j = 0; received && j < numReplies; j++) {
+            string reply;
+            received = recvString(controlSocket, reply);
+            session->pendingReplies.push_back(reply);
+        }
+        received = received && recvUint32(controlSocket, numAnnounces);
+        for (uint32_t j = 0; received && j < numAnnounces; j++) {
+            pair<uint32_t, string> announce;
+            received = recvUint32(controlSocket, announce.first) && recvString(controlSocket, announce.second);
+            session->pendingAnnounces.push_back(announce);
+        }
+        sessions.push_back(session);
+    }
+
+    char ack = 1;
+    received = received && sendAll(controlSocket, &ack, sizeof(ack));
+    closesocket(controlSocket);
+    if (!received) {
+        cerr << "Handoff from the running server failed" << endl;
+        return false;
+    }
+
+    cout << "Took over " << sessions.size() << " clients" << endl;
+    return true;
+}
+
+// Loopback only listener for hot restarts, the port is retried for a while after a
+// takeover since the old process frees it only once it accepted our connection
+SOCKET openControlSocket() {
+    for (int attempt = 0; attempt < 25; attempt++) {
+        SOCKET controlSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        sockaddr_in address;
+        address.sin_family = AF_INET;
+        address.sin_port = htons(handoffPort);
+        inet_pton(AF_INET, "127.0.0.1", &address.sin_addr);
+        if (controlSocket != INVALID_SOCKET &&
+            bind(controlSocket, (sockaddr*)&address, sizeof(address)) != SOCKET_ERROR &&
+            listen(controlSocket, 1) != SOCKET_ERROR) {
+            return controlSocket;
+        }
+        closesocket(controlSocket);
+        this_thread::sleep_for(chrono::milliseconds(POLL_INTERVAL_MS));
+    }
+
+    cerr << "Unable to listen on handoff port " << handoffPort << ", hot restart disabled" << endl;
+    return INVALID_SOCKET;
+}
 
-    closesocket(clientSocket);
-    cout << clientNameStr << " disconnected.\n";
+void signal_callback_handler(int) {
+    stopRequested = 1;
 }
 
-int main() {
+int main(int argc, char* argv[]) {
+    signal(SIGINT, signal_callback_handler);
     WSADATA wsaData;
     int result;
 
+    bool takeover = false;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--takeover") {
+            takeover = true;
+        }
+        else if (arg == "--port" && i + 1 < argc) {
+            listenPort = atoi(argv[++i]);
+            handoffPort = listenPort + 1;
+        }
+        else if (arg == "--upstream" && i + 1 < argc) {
+            upstreamAddress = argv[++i];
+        }
+        else if (arg == "--cache-mb" && i + 1 < argc) {
+            cacheMaxBytes = atoll(argv[++i]) * 1024 * 1024;
+        }
+        else {
+            cerr << "Usage: server2 [--port N] [--takeover] [--upstream ip:port] [--cache-mb N]" << endl;
+            return 1;
+        }
+    }
+
     // Initialize Winsock
     result = WSAStartup(MAKEWORD(2, 2), &wsaData);
     if (result != 0) {
@@ -183,49 +1572,143 @@ int main() {
         return 1;
     }
 
-    SOCKET serverSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    if (serverSocket == INVALID_SOCKET) {
-        cerr << "Socket creation failed: " << WSAGetLastError() << endl;
-        WSACleanup();
-        return 1;
+    // Proxy mode: the file list is the upstream server's
+    vector<FileInfo> fileList;
+    if (!upstreamAddress.empty()) {
+        lock_guard<mutex> lock(upstreamMutex);
+        // With --takeover the cache belongs to the running server until the handoff, it is opened after it
+        if ((!takeover && !openCache()) || !connectUpstream(&fileList)) {
+            WSACleanup();
+            return 1;
+        }
+        cout << "Proxying " << upstreamAddress << endl;
+    }
+    else {
+        fileList = readFileList("file_list.txt");
     }
 
-    sockaddr_in address;
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = htonl(INADDR_ANY);
-    address.sin_port = htons(PORT);
+    SOCKET serverSocket;
+    vector<shared_ptr<ClientSession>> restoredSessions;
+    if (takeover) {
+        // Hot restart: continue serving the listening socket and clients of the running server
+        if (!takeOver(serverSocket, restoredSessions)) {
+            WSACleanup();
+            return 1;
+        }
 
-    if (bind(serverSocket, (sockaddr*)&address, sizeof(address)) == SOCKET_ERROR) {
-        cerr << "Bind failed: " << WSAGetLastError() << endl;
-        closesocket(serverSocket);
-        WSACleanup();
-        return 1;
+        // The old process is done with the cache, it only exits after the handoff
+        if (!upstreamAddress.empty()) {
+            if (!openCache()) {
+                closesocket(serverSocket);
+                WSACleanup();
+                return 1;
+            }
+            for (const auto& session : restoredSessions) {
+                for (auto& request : session->requestedFiles) {
+                    uint32_t fileSize;
+                    cachedFileSize(request.fileName, request.cacheEntry, session->stopping, fileSize); // Refetched if it was still arriving
+                }
+            }
+        }
     }
+    else {
+        serverSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (serverSocket == INVALID_SOCKET) {
+            cerr << "Socket creation failed: " << WSAGetLastError() << endl;
+            WSACleanup();
+            return 1;
+        }
 
-    if (listen(serverSocket, SOMAXCONN) == SOCKET_ERROR) {
-        cerr << "Listen failed: " << WSAGetLastError() << endl;
-        closesocket(serverSocket);
-        WSACleanup();
-        return 1;
-    }
+        sockaddr_in address;
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_ANY);
+        address.sin_port = htons(listenPort);
 
-    vector<FileInfo> fileList = readFileList("file_list.txt");
-    cout << "Server is waiting on PORT " << PORT << "..." << endl;
+        if (bind(serverSocket, (sockaddr*)&address, sizeof(address)) == SOCKET_ERROR) {
+            cerr << "Bind failed: " << WSAGetLastError() << endl;
+            closesocket(serverSocket);
+            WSACleanup();
+            return 1;
+        }
 
-    while (true) {
-        SOCKET clientSocket = accept(serverSocket, NULL, NULL);
-        if (clientSocket == INVALID_SOCKET) {
-            cerr << "Accept failed: " << WSAGetLastError() << endl;
+        if (listen(serverSocket, SOMAXCONN) == SOCKET_ERROR) {
+            cerr << "Listen failed: " << WSAGetLastError() << endl;
             closesocket(serverSocket);
             WSACleanup();
             return 1;
         }
+    }
+
+    for (const auto& session : restoredSessions) {
+        thread sessionThread(runSession, session, fileList);
+        sessionThread.detach();
+    }
+
+    SOCKET controlSocket = openControlSocket();
+    cout << "Server is waiting on PORT " << listenPort << "..." << endl;
+
+    while (!stopRequested) {
+        // Poll so Ctrl+C is noticed, and watch the handoff port next to the listening socket
+        fd_set readable;
+        FD_ZERO(&readable);
+        FD_SET(serverSocket, &readable);
+        SOCKET maxSocket = serverSocket;
+        if (controlSocket != INVALID_SOCKET) {
+            FD_SET(controlSocket, &readable);
+            maxSocket = max(maxSocket, controlSocket);
+        }
+        timeval timeout = { 0, POLL_INTERVAL_MS * 1000 };
+        int ready = select(maxSocket + 1, &readable, NULL, NULL, &timeout);
+        if (ready == SOCKET_ERROR) {
+            if (stopRequested) {
+                break;
+            }
+            cerr << "Select failed: " << WSAGetLastError() << endl;
+            break;
+        }
+
+        if (controlSocket != INVALID_SOCKET && FD_ISSET(controlSocket, &readable)) {
+            SOCKET newProcess = accept(controlSocket, NULL, NULL);
+            closesocket(controlSocket); // The new process listens on this port next
+            controlSocket = INVALID_SOCKET;
 
-        thread clientThread(handleClient, clientSocket, fileList);
-        clientThread.detach();
+            bool handedOff = newProcess != INVALID_SOCKET && handOffTo(newProcess, serverSocket);
+            closesocket(newProcess);
+            if (handedOff) {
+                closesocket(serverSocket);
+                WSACleanup();
+                TRACE_FLUSH();
+                cout << "Handoff complete, exiting." << endl;
+                return 0;
+            }
+
+            // Whatever went wrong, this process stays in charge
+            resumeSessions(fileList);
+            controlSocket = openControlSocket();
+            continue;
+        }
+
+        if (FD_ISSET(serverSocket, &readable)) {
+            SOCKET clientSocket = accept(serverSocket, NULL, NULL);
+            if (clientSocket == INVALID_SOCKET) {
+                cerr << "Accept failed: " << WSAGetLastError() << endl;
+                continue;
+            }
+
+            thread clientThread(handleClient, clientSocket, fileList);
+            clientThread.detach();
+        }
     }
 
+    // Stop accepting first, then let the active downloads finish
+    cout << "Shutting down..." << endl;
     closesocket(serverSocket);
+    if (controlSocket != INVALID_SOCKET) {
+        closesocket(controlSocket);
+    }
+    drainSessions();
+
     WSACleanup();
+    TRACE_FLUSH();
     return 0;
 }
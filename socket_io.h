@@ -0,0 +1,116 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <climits>
+typedef int SOCKET;
+#ifndef SOCKET_ERROR
+#define SOCKET_ERROR (-1)
+#endif
+#endif
+
+// Blocking socket I/O shared by server.cpp, client.cpp, server2.cpp, client2.cpp and the
+// benchmarks in bench/: whole sends and receives, and gathered sends of several buffers.
+
+// send() may accept fewer bytes than asked for, keep going until everything is out
+inline bool sendAll(SOCKET socket, const char* data, int length) {
+    while (length > 0) {
+        int sent = send(socket, data, length, 0);
+        if (sent == SOCKET_ERROR || sent == 0) {
+            return false;
+        }
+        data += sent;
+        length -= sent;
+    }
+    return true;
+}
+
+// recv() may return a partial message, keep reading until the whole message arrived
+inline bool recvAll(SOCKET socket, char* data, int length) {
+    while (length > 0) {
+        int received = recv(socket, data, length, 0);
+        if (received <= 0) {
+            return false;
+        }
+        data += received;
+        length -= received;
+    }
+    return true;
+}
+
+// One buffer of a gathered send, WSABUF on Windows and iovec elsewhere
+#ifdef _WIN32
+typedef WSABUF SendBuffer;
+
+inline SendBuffer makeSendBuffer(const void* data, size_t length) {
+    SendBuffer buffer;
+    buffer.len = (ULONG)length;
+    buffer.buf = (char*)data;
+    return buffer;
+}
+
+inline size_t sendBufferLength(const SendBuffer& buffer) {
+    return buffer.len;
+}
+
+inline void skipSentBytes(SendBuffer& buffer, size_t sent) {
+    buffer.buf += sent;
+    buffer.len -= (ULONG)sent;
+}
+#else
+typedef iovec SendBuffer;
+
+inline SendBuffer makeSendBuffer(const void* data, size_t length) {
+    SendBuffer buffer;
+    buffer.iov_base = (void*)data;
+    buffer.iov_len = length;
+    return buffer;
+}
+
+inline size_t sendBufferLength(const SendBuffer& buffer) {
+    return buffer.iov_len;
+}
+
+inline void skipSentBytes(SendBuffer& buffer, size_t sent) {
+    buffer.iov_base = (char*)buffer.iov_base + sent;
+    buffer.iov_len -= sent;
+}
+#endif
+
+// Gather-write several buffers with one call instead of copying them into a single buffer.
+// The buffers are advanced past what went out.
+inline bool sendAllVectored(SOCKET socket, std::vector<SendBuffer>& buffers) {
+    size_t first = 0;
+    while (first < buffers.size()) {
+#ifdef _WIN32
+        DWORD sent = 0;
+        if (WSASend(socket, &buffers[first], (DWORD)(buffers.size() - first), &sent, 0, NULL, NULL) == SOCKET_ERROR) {
+            return false;
+        }
+#else
+        size_t count = buffers.size() - first;
+#ifdef IOV_MAX
+        count = count < IOV_MAX ? count : IOV_MAX; // writev takes at most this many, a big bundle goes out in several calls
+#endif
+        ssize_t result = writev(socket, &buffers[first], (int)count);
+        if (result < 0) {
+            return false;
+        }
+        size_t sent = (size_t)result;
+#endif
+        // Skip what went out, a blocking socket normally sends everything at once
+        while (first < buffers.size() && sent >= sendBufferLength(buffers[first])) {
+            sent -= sendBufferLength(buffers[first]);
+            first++;
+        }
+        if (first < buffers.size()) {
+            skipSentBytes(buffers[first], sent);
+        }
+    }
+    return true;
+}
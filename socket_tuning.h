@@ -0,0 +1,163 @@
+#pragma once
+
+#include <cstdint>
+#include <chrono>
+#include <algorithm>
+#include <fstream>
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <mstcpip.h>
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+typedef int SOCKET;
+#endif
+
+// Per-connection transfer tuning shared by server.cpp, client.cpp, server2.cpp and client2.cpp.
+//
+// Every TUNE_INTERVAL_MS the throughput of the last interval and the RTT reported by the
+// kernel (SIO_TCP_INFO on Windows, TCP_INFO elsewhere) give the bandwidth-delay product.
+// Chunks are sized to a quarter of it, so a few chunks (and the chunks of other files) are
+// in flight at once, but never below a millisecond worth of data, so fast low latency links
+// do not pay a system call per few kilobytes.
+//
+// Socket buffers are left to the OS auto-tuning as long as it keeps up: setting SO_RCVBUF or
+// SO_SNDBUF turns it off for that socket (and on Linux clamps the size to net.core.[rw]mem_max).
+// The receive buffer is never set. The send buffer is set to twice the product only once the
+// OS stopped growing it by itself (Linux stops at net.ipv4.tcp_wmem, Windows at the ideal send
+// backlog) short of that, and only if the size we can set is larger than what the OS has.
+
+#define MIN_CHUNK_SIZE (4 * 1024)
+#define MAX_CHUNK_SIZE (256 * 1024)
+#define INITIAL_CHUNK_SIZE (16 * 1024)
+#define MAX_SOCKET_BUFFER (16 * 1024 * 1024)
+#define TUNE_INTERVAL_MS 250
+
+struct TransferTuner {
+    uint32_t chunkSize = INITIAL_CHUNK_SIZE;
+    int socketBufferSize = 0; // Send buffer at the last interval, 0 until first read
+    uint32_t rttMicroseconds = 0;
+    double bytesPerSecond = 0;
+    uint64_t bytesThisInterval = 0;
+    std::chrono::steady_clock::time_point intervalStart = std::chrono::steady_clock::now();
+};
+
+inline bool queryRttMicroseconds(SOCKET socket, uint32_t& rttMicroseconds) {
+#ifdef _WIN32
+    DWORD version = 0;
+    DWORD bytesReturned = 0;
+    TCP_INFO_v0 info;
+    if (WSAIoctl(socket, SIO_TCP_INFO, &version, sizeof(version), &info, sizeof(info), &bytesReturned, NULL, NULL) != 0) {
+        return false;
+    }
+    rttMicroseconds = info.RttUs;
+#else
+    tcp_info info;
+    socklen_t length = sizeof(info);
+    if (getsockopt(socket, IPPROTO_TCP, TCP_INFO, &info, &length) != 0) {
+        return false;
+    }
+    rttMicroseconds = info.tcpi_rtt;
+#endif
+    return true;
+}
+
+// Frames are written with a single gathered send (header and payload together), which is
+// what TCP_CORK would give us, so Nagle only adds delay for the last frame of a burst.
+// On Linux TCP_NOTSENT_LOWAT also keeps the unsent part of the queue short, a frame of a
+// higher priority file is then not stuck behind a full send buffer. Windows has no such
+// option, its send buffer auto-tuning (ideal send backlog) plays that role.
+inline void configureTransferSocket(SOCKET socket) {
+    int on = 1;
+    setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, (char*)&on, sizeof(on));
+#ifdef TCP_NOTSENT_LOWAT
+    int lowWatermark = MAX_CHUNK_SIZE;
+    setsockopt(socket, IPPROTO_TCP, TCP_NOTSENT_LOWAT, (char*)&lowWatermark, sizeof(lowWatermark));
+#endif
+}
+
+// Send buffer the OS holds for the socket right now, auto-tuned unless we set it
+inline int currentSendBufferSize(SOCKET socket) {
+    int size = 0;
+    socklen_t length = sizeof(size);
+    getsockopt(socket, SOL_SOCKET, SO_SNDBUF, (char*)&size, &length);
+#ifdef _WIN32
+    // SO_SNDBUF stays at its default while the stack sizes the backlog itself
+    ULONG idealBacklog = 0;
+    DWORD bytesReturned = 0;
+    if (WSAIoctl(socket, SIO_IDEAL_SEND_BACKLOG_QUERY, NULL, 0, &idealBacklog, sizeof(idealBacklog), &bytesReturned, NULL, NULL) == 0) {
+        size = (std::max)(size, (int)idealBacklog);
+    }
+#endif
+    return size;
+}
+
+// Largest send buffer setsockopt gives us, Linux clamps the request to net.core.wmem_max and doubles it
+inline int maxSettableSendBuffer() {
+#ifdef __linux__
+    static const int limit = []() {
+        int wmemMax = 0;
+        std::ifstream("/proc/sys/net/core/wmem_max") >> wmemMax;
+        return 2 * (std::min)(wmemMax, MAX_SOCKET_BUFFER);
+    }();
+    return limit;
+#else
+    return MAX_SOCKET_BUFFER;
+#endif
+}
+
+// Account for `bytes` just sent (sendSide) or received, retune once per interval.
+// Returns true when the chunk size or send buffer changed.
+inline bool updateTransferTuning(SOCKET socket, TransferTuner& tuner, uint64_t bytes, bool sendSide) {
+    tuner.bytesThisInterval += bytes;
+    auto now = std::chrono::steady_clock::now();
+    double seconds = std::chrono::duration<double>(now - tuner.intervalStart).count();
+    if (seconds * 1000 < TUNE_INTERVAL_MS) {
+        return false;
+    }
+
+    uint32_t rtt;
+    if (queryRttMicroseconds(socket, rtt) && rtt > 0) {
+        tuner.rttMicroseconds = rtt;
+    }
+    tuner.bytesPerSecond = tuner.bytesThisInterval / seconds;
+    tuner.bytesThisInterval = 0;
+    tuner.intervalStart = now;
+    if (tuner.rttMicroseconds == 0) {
+        return false;
+    }
+
+    double bandwidthDelay = tuner.bytesPerSecond * tuner.rttMicroseconds / 1e6;
+    double chunkTarget = (std::max)(bandwidthDelay / 4, tuner.bytesPerSecond / 1000);
+    bool changed = false;
+
+    uint32_t chunkSize = MIN_CHUNK_SIZE;
+    while (chunkSize < chunkTarget && chunkSize < MAX_CHUNK_SIZE) {
+        chunkSize *= 2;
+    }
+    if (chunkSize != tuner.chunkSize) {
+        tuner.chunkSize = chunkSize;
+        changed = true;
+    }
+
+    if (!sendSide) {
+        return changed;
+    }
+    int osBufferSize = currentSendBufferSize(socket);
+    bool autoTuning = osBufferSize > tuner.socketBufferSize; // Still growing by itself, leave it alone
+    tuner.socketBufferSize = osBufferSize;
+    int bufferSize = (int)(std::min)(2 * bandwidthDelay, (double)maxSettableSendBuffer());
+#ifdef __linux__
+    int request = bufferSize / 2; // Linux doubles the request for its bookkeeping
+#else
+    int request = bufferSize;
+#endif
+    if (!autoTuning && bufferSize > osBufferSize * 5 / 4 &&
+        setsockopt(socket, SOL_SOCKET, SO_SNDBUF, (char*)&request, sizeof(request)) == 0) {
+        tuner.socketBufferSize = currentSendBufferSize(socket);
+        changed = true;
+    }
+    return changed;
+}
@@ -0,0 +1,148 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+
+// Scoped timing probes for the hot paths of server2.cpp and client2.cpp.
+//
+//   TRACE_SCOPE("sendFileChunks");
+//
+// times the rest of the enclosing block. Probes are compiled in for debug builds (or with
+// ENABLE_TRACE) and compile to nothing in release builds (NDEBUG). They record only when the
+// TRACE_FILE environment variable names an output file, which TRACE_FLUSH() writes in the Chrome
+// trace-event format: open it in chrome://tracing or https://ui.perfetto.dev. Traces of several
+// processes (a server and its clients) can be loaded together, events carry the process id.
+//
+// Call TRACE_FLUSH() on every way out of the program. It stops recording before it writes, and
+// the recorder itself is never destroyed, so detached threads still inside a probe at exit do
+// not touch a destroyed recorder and their late events are simply dropped.
+
+#if defined(ENABLE_TRACE) || !defined(NDEBUG)
+#define TRACE_ENABLED 1
+#endif
+
+#define TRACE_MAX_EVENTS (1 << 20) // Recording stops here, about 32MB of events
+
+#ifdef TRACE_ENABLED
+
+class TraceRecorder {
+public:
+    static TraceRecorder& instance() {
+        static TraceRecorder* recorder = new TraceRecorder(); // Intentionally leaked, see above
+        return *recorder;
+    }
+
+    bool active() const {
+        return !path.empty();
+    }
+
+    int64_t now() const {
+        return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    // `name` must be a string literal, only the pointer is kept
+    void record(const char* name, int64_t startMicroseconds, int64_t durationMicroseconds) {
+        static thread_local uint32_t threadId = nextThreadId++;
+        std::lock_guard<std::mutex> lock(eventsMutex);
+        if (!stopped && events.size() < TRACE_MAX_EVENTS) {
+            events.push_back({ name, startMicroseconds, durationMicroseconds, threadId });
+        }
+    }
+
+    // Stop recording and write the trace, later calls do nothing
+    bool flush() {
+        std::lock_guard<std::mutex> lock(eventsMutex);
+        if (!active() || stopped) {
+            return true;
+        }
+        stopped = true;
+        FILE* file = fopen(path.c_str(), "w");
+        if (!file) {
+            return false;
+        }
+#ifdef _WIN32
+        int processId = _getpid();
+#else
+        int processId = getpid();
+#endif
+        fprintf(file, "{\"traceEvents\":[\n");
+        for (size_t i = 0; i < events.size(); i++) {
+            const Event& event = events[i];
+            fprintf(file, "{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,\"pid\":%d,\"tid\":%u}%s\n",
+                event.name, (long long)event.start, (long long)event.duration, processId, event.thread,
+                i + 1 < events.size() ? "," : "");
+        }
+        fprintf(file, "],\"displayTimeUnit\":\"ms\"}\n");
+        return fclose(file) == 0;
+    }
+
+private:
+    struct Event {
+        const char* name;
+        int64_t start;
+        int64_t duration;
+        uint32_t thread;
+    };
+
+    TraceRecorder() : start(std::chrono::steady_clock::now()) {
+#ifdef _MSC_VER
+        char* file = NULL;
+        size_t length = 0;
+        if (_dupenv_s(&file, &length, "TRACE_FILE") == 0 && file) {
+            path = file;
+            free(file);
+        }
+#else
+        const char* file = getenv("TRACE_FILE");
+        if (file) {
+            path = file;
+        }
+#endif
+    }
+
+    std::chrono::steady_clock::time_point start;
+    std::string path;
+    std::vector<Event> events;
+    bool stopped = false;
+    std::mutex eventsMutex;
+    std::atomic<uint32_t> nextThreadId{ 1 };
+};
+
+class TraceScope {
+public:
+    explicit TraceScope(const char* name) : name(name), start(TraceRecorder::instance().active() ? TraceRecorder::instance().now() : -1) {}
+
+    ~TraceScope() {
+        if (start >= 0) {
+            TraceRecorder& recorder = TraceRecorder::instance();
+            recorder.record(name, start, recorder.now() - start);
+        }
+    }
+
+private:
+    const char* name;
+    int64_t start;
+};
+
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(traceScope, __LINE__)(name)
+#define TRACE_FLUSH() TraceRecorder::instance().flush()
+
+#else
+
+#define TRACE_SCOPE(name)
+#define TRACE_FLUSH()
+
+#endif